@@ -1,51 +1,530 @@
+#include <asm/arch_timer.h>
 #include <asm/current.h>
 #include <asm/io.h>
 #include <asm/page.h>
+#include <asm/sections.h>
+#include <linux/atomic.h>
+#include <linux/cgroup.h>
+#include <linux/err.h>
 #include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
 #include <linux/kallsyms.h>
 #include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/memcontrol.h>
 #include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/pagemap.h>
+#include <linux/perf_event.h>
 #include <linux/pfn.h>
+#include <linux/pid.h>
+#include <linux/pid_namespace.h>
+#include <linux/poll.h>
 #include <linux/proc_fs.h>
+#include <linux/rbtree.h>
+#include <linux/rcupdate.h>
 #include <linux/rmap.h>
+#include <linux/sched.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/smp.h>
 #include <linux/spinlock.h>
 #include <linux/spinlock_types.h>
+#include <linux/topology.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/wait.h>
 
 /* Global Defines */
-#define CACHESETS_TO_WRITE 2048
-#define L2_SIZE 2*1024*1024
 #define MODNAME "dumpcache"
-#define WAYS 16
+
+/* Largest L2 that the RAMINDEX encoding and the packed format can
+ * describe. The actual geometry is read from the CPU at init. */
+#define MAX_CACHESETS 4096
+#define MAX_WAYS 16
+
+/* Number of sets get_tag rebuilds addresses for: the set index
+ * makes up the address bits right below the tag */
+#define TAG_SETS 2048
 
 /* Command to access the configuration interface */
 #define DUMPCACHE_CMD_CONFIG _IOW(0, 0, unsigned long)
 /* Command to initiate a cache dump */
 #define DUMPCACHE_CMD_SNAPSHOT _IOW(0, 1, unsigned long)
+/* Command to set the number of samples between keyframes in delta mode */
+#define DUMPCACHE_CMD_KEYFRAME _IOW(0, 2, unsigned long)
+/* Command to retrieve the geometry of the L2 */
+#define DUMPCACHE_CMD_GEOMETRY _IOR(0, 3, struct cache_geometry)
+/* Command to retrieve the state of the sample ring */
+#define DUMPCACHE_CMD_RING_STATUS _IOR(0, 4, struct ring_status)
+/* Command to release the oldest samples in the ring */
+#define DUMPCACHE_CMD_RING_CONSUME _IOW(0, 5, unsigned long)
+/* Command to start in-kernel periodic sampling with the given
+ * period in ns, or to stop it if the period is 0 */
+#define DUMPCACHE_CMD_PERIODIC _IOW(0, 6, unsigned long)
+/* Command to restrict snapshots to part of the L2 */
+#define DUMPCACHE_CMD_SELECT _IOW(0, 7, struct dump_selection)
+/* Command to choose the PMU events counted along with snapshots */
+#define DUMPCACHE_CMD_PMU_EVENTS _IOW(0, 8, struct pmu_events)
+/* Command to start taking snapshots every time a PMU counter
+ * overflows, or to stop if the period is 0 */
+#define DUMPCACHE_CMD_TRIGGER _IOW(0, 9, struct pmu_trigger)
+/* Command to choose which CPUs are stalled during snapshots */
+#define DUMPCACHE_CMD_STALL _IOW(0, 10, struct stall_policy)
+/* Command to set the processes under observation */
+#define DUMPCACHE_CMD_TARGETS _IOW(0, 11, struct dump_targets)
+/* Command to only resolve and store the lines of some processes */
+#define DUMPCACHE_CMD_FILTER _IOW(0, 12, struct dump_filter)
 
 #define FULL_ADDRESS 0
 
-#pragma GCC push_options
-#pragma GCC optimize ("O0")
-// Might need this
-//pragma GCC pop_options
 /* Struct representing a single cache line - each cacheline struct is 68 bytes */
 struct cache_line
 {
 	pid_t pid;
+	uint32_t state;		/* Coherence state bits of the tag */
 	uint64_t addr;
 };
 
-struct cache_set
+/* A sample in the full format is an array of sets * ways lines, in
+ * set-major, way-minor order */
+
+/* Geometry of the L2, as described by CCSIDR_EL1 */
+struct cache_geometry
+{
+	uint32_t sets;
+	uint32_t ways;
+	uint32_t line_size;
+	uint32_t size;
+};
+
+/* State of the sample ring, as seen by the consumer. Offsets are
+ * the same used by the mmap interface. */
+struct ring_status
+{
+	uint64_t head;		/* Where the next sample will be stored */
+	uint64_t tail;		/* Oldest sample not consumed yet */
+	uint64_t len;		/* Size of the ring in bytes */
+	uint32_t pending;	/* Samples stored and not consumed yet */
+	uint32_t overruns;	/* Samples dropped because the ring was full */
+};
+
+/* Part of the L2 captured by each snapshot: the ways in way_mask of
+ * sets [first_set, last_set). A last_set or way_mask of 0 stands for
+ * all the sets or all the ways. */
+struct dump_selection
+{
+	uint32_t first_set;
+	uint32_t last_set;
+	uint32_t way_mask;
+};
+
+/* Counters read on each CPU with every snapshot */
+#define MAX_PMU_EVENTS       6
+#define PMU_EVENT_NONE       (~0U)
+
+/* ARMv8 PMU event numbers, PMU_EVENT_NONE for unused slots */
+struct pmu_events
+{
+	uint32_t events[MAX_PMU_EVENTS];
+};
+
+/* Snapshot every period occurrences of an ARMv8 PMU event on a CPU */
+struct pmu_trigger
+{
+	uint32_t cpu;
+	uint32_t event;
+	uint64_t period;
+};
+
+/* CPUs other than the one taking the snapshot that are stalled */
+#define STALL_POLICY_ALL     0	/* All the online ones */
+#define STALL_POLICY_CPUMASK 1	/* Those in cpus */
+#define STALL_POLICY_TARGETS 2	/* Those running threads of the targets,
+				 * or of the cgroup lines are filtered on */
+
+struct stall_policy
+{
+	uint32_t policy;
+	uint32_t reserved;
+	uint64_t cpus;		/* One bit per CPU */
+};
+
+/* Processes under observation, as pids of the caller's namespace */
+#define MAX_TARGETS          64
+
+struct dump_targets
+{
+	uint32_t count;
+	int32_t pids[MAX_TARGETS];
+};
+
+/* Lines that are resolved and stored individually */
+#define FILTER_NONE          0	/* All of them */
+#define FILTER_TARGETS       1	/* Those of the targets */
+#define FILTER_CGROUP        2	/* Those charged to a cgroup v2 or below */
+
+#define FILTER_PATH_MAX      256
+
+struct dump_filter
+{
+	uint32_t mode;
+	uint32_t reserved;
+	char cgroup[FILTER_PATH_MAX];	/* Relative to the cgroup v2 root */
+};
+
+/* Header preceding each variable-size record stored in the buffers.
+ * Full samples carry one too, right after their lines. */
+struct sample_hdr
+{
+	uint32_t magic;
+	uint32_t size;		/* Total size of the record, header included */
+	uint32_t entries;	/* Number of lines stored in the record */
+	uint32_t flags;
+	uint16_t first_set;	/* Selection the record was captured with */
+	uint16_t last_set;
+	uint16_t way_mask;
+	uint8_t stall_policy;	/* Policy the record was captured with */
+	uint8_t stalled;	/* Bitmask of the first 8 CPUs that were stalled */
+};
+
+/* Compact sample: only valid lines are stored. For each set, the
+ * valid bitmap has one bit per way; the lines of all the sets follow
+ * the bitmaps in set-major, way-minor order, so set and way of each
+ * line are implied by its position. */
+struct packed_sample
+{
+	struct sample_hdr hdr;
+	uint16_t valid[];
+};
+
+/* Lines start at the first 8-byte boundary after the bitmaps */
+#define PACKED_LINES(sample, sets)					\
+	((uint64_t *)&(sample)->valid[ALIGN((sets), 4)])
+#define PACKED_SAMPLE_SIZE(sets, count)					\
+	(sizeof(struct packed_sample) + ALIGN((sets), 4) * sizeof(uint16_t) + \
+	 (count) * sizeof(uint64_t))
+
+/* Delta sample: only the (set, way) pairs that changed since the
+ * previous sample. The new content of each changed pair, in packed
+ * form or 0 if the way became invalid, is followed by the positions
+ * (set * ways + way) of the pairs, one uint16_t each. */
+struct delta_sample
+{
+	struct sample_hdr hdr;
+	uint64_t lines[];
+};
+
+#define SAMPLE_MAGIC_PACKED  0x4b434150 /* "PACK" */
+#define SAMPLE_MAGIC_DELTA   0x544c4544 /* "DELT" */
+#define SAMPLE_MAGIC_PAD     0x20444150 /* "PAD " - skip to next aperture */
+#define SAMPLE_MAGIC_AGGREGATE 0x52474741 /* "AGGR" */
+#define SAMPLE_MAGIC_FULL    0x4c4c5546 /* "FULL" - header of a full sample */
+
+/* Set in the header if lines carry pid and virtual address */
+#define SAMPLE_FLAG_RESOLVED (1 << 0)
+/* Set in the header if the record ends with a core section */
+#define SAMPLE_FLAG_CORES    (1 << 1)
+/* Set in the header if the record ends with a timing section */
+#define SAMPLE_FLAG_TIMING   (1 << 2)
+/* Set in the header if the record carries a PMU section */
+#define SAMPLE_FLAG_PMU      (1 << 3)
+/* Set in the header if the lines are followed by an other section */
+#define SAMPLE_FLAG_OTHER    (1 << 4)
+/* Set in the header if the owners of a summary are cgroups */
+#define SAMPLE_FLAG_CGROUPS  (1 << 5)
+/* Set in the header if the lines are followed by a kernel section */
+#define SAMPLE_FLAG_KERNEL   (1 << 6)
+
+/* Packed line: | 63..22 line address >> 6 | 21..20 state | 19..0 pid |
+ * The address holds 48-bit virtual addresses. Pids are below
+ * PACKED_PID_LIMIT, which the module checks against pid_max. */
+#define PACKED_PID_BITS      20
+#define PACKED_PID_MASK      ((1UL << PACKED_PID_BITS) - 1)
+#define PACKED_PID_LIMIT     ((pid_t)(PACKED_PID_MASK - 0x10))
+#define PACKED_STATE_SHIFT   20
+#define PACKED_STATE_MASK    (0x3UL << PACKED_STATE_SHIFT)
+#define PACKED_ADDR_SHIFT    22
+#define PACKED_LINE(pid, addr)						\
+	((((uint64_t)(addr) >> 6) << PACKED_ADDR_SHIFT) | ((uint64_t)(pid) & PACKED_PID_MASK))
+#define PACKED_STATE(state)    (((uint64_t)(state) << PACKED_STATE_SHIFT) & PACKED_STATE_MASK)
+#define PACKED_LINE_PID(line)  ((pid_t)((line) & PACKED_PID_MASK))
+#define PACKED_LINE_STATE(line) ((uint32_t)(((line) & PACKED_STATE_MASK) >> PACKED_STATE_SHIFT))
+#define PACKED_LINE_ADDR(line) (((line) >> PACKED_ADDR_SHIFT) << 6)
+
+/* Pid of the lines ruled out by the filter. Their address is left
+ * physical. */
+#define FILTERED_PID         ((pid_t)PACKED_PID_MASK)
+#define PACKED_LINE_FILTERED(line) (PACKED_LINE_PID(line) == FILTERED_PID)
+/* Records store filtered lines as invalid ones */
+#define STORED_LINE(line)    (PACKED_LINE_FILTERED(line) ? 0 : (line))
+
+/* With classification enabled, the lines of pages that no process
+ * maps are reported with the pid of the kind of page they belong
+ * to. Their address is left physical. */
+#define PAGE_CLASS_PAGECACHE 1	/* Page cache */
+#define PAGE_CLASS_SLAB      2	/* Slab objects */
+#define PAGE_CLASS_KERNEL    3	/* Kernel text and data */
+#define PAGE_CLASS_PGTABLE   4	/* Page tables */
+#define PAGE_CLASS_FREE      5	/* Free pages */
+#define PAGE_CLASS_OTHER     6	/* Any other kernel page */
+
+#define PAGE_CLASS_PID_BASE  PACKED_PID_LIMIT
+#define PAGE_CLASS_PID(class) (PAGE_CLASS_PID_BASE + (class))
+#define PAGE_CLASS_OF(pid)						\
+	((pid) > PAGE_CLASS_PID_BASE && (pid) < FILTERED_PID ? (pid) - PAGE_CLASS_PID_BASE : 0)
+
+/* Page cache and slab pages holding lines of a record, as listed in
+ * its kernel section */
+#define KERNEL_NAME_LEN      16
+
+struct kernel_page
+{
+	uint64_t pfn;
+	uint32_t class;
+	uint32_t lines;		/* Lines of the page in the selection */
+	uint64_t ino;		/* Page cache: inode of the file */
+	uint64_t index;		/* Page cache: offset in the file, in pages */
+	char name[KERNEL_NAME_LEN];	/* Slab: name of the cache */
+};
+
+/* The kernel section lists up to MAX_KERNEL_PAGES pages, in the order
+ * their first line was found. Lines of the other pages are counted
+ * as dropped. */
+#define MAX_KERNEL_PAGES     256
+
+struct kernel_section
+{
+	uint32_t count;
+	uint32_t dropped;
+	struct kernel_page pages[];
+};
+
+#define KERNEL_SECTION_SIZE(count)					\
+	(sizeof(struct kernel_section) + (count) * sizeof(struct kernel_page))
+#define KERNEL_SECTION_MAX_SIZE						\
+	((flags & DUMPCACHE_CMD_CLASSIFY_EN_SHIFT) ? KERNEL_SECTION_SIZE(MAX_KERNEL_PAGES) : 0)
+
+/* With a filter, records store one byte per selected set right after
+ * the lines: the number of valid lines that were filtered out */
+#define OTHER_SECTION_SIZE(sets) ALIGN((sets), sizeof(uint64_t))
+#define OTHER_SECTION_MAX_SIZE						\
+	(filter.mode != FILTER_NONE ? OTHER_SECTION_SIZE(geom.sets) : 0)
+
+#define DELTA_SAMPLE_SIZE(count)					\
+	ALIGN(sizeof(struct delta_sample) + (count) *			\
+	      (sizeof(uint64_t) + sizeof(uint16_t)), sizeof(uint64_t))
+
+/* Occupancy summary, stored instead of the lines in aggregate mode.
+ * The number of valid lines of each selected set, one byte each, is
+ * followed by the number of valid lines of each page color of the
+ * L2, and then by one entry per owner. Owners are the pids the lines
+ * resolved to or, with SAMPLE_FLAG_CGROUPS, the ids of the cgroups
+ * v2 of those processes; 0 stands for no owner. */
+struct aggregate_sample
+{
+	struct sample_hdr hdr;	/* entries is the number of owners */
+	uint32_t valid;		/* Valid lines in the selection */
+	uint32_t filtered;	/* Of which ruled out by the filter */
+	uint16_t sets;		/* Selected sets */
+	uint16_t colors;	/* Page colors of the L2 */
+	uint32_t reserved;
+	uint8_t set_valid[];
+};
+
+struct aggregate_owner
+{
+	uint32_t id;
+	uint32_t lines;
+};
+
+/* Sets covered by a page, i.e. sets of the same color */
+#define AGGREGATE_COLOR_SETS (PAGE_SIZE / 64)
+
+#define AGGREGATE_COLORS(sample)					\
+	((uint32_t *)&(sample)->set_valid[ALIGN((sample)->sets, 8)])
+#define AGGREGATE_OWNERS(sample)					\
+	((struct aggregate_owner *)&AGGREGATE_COLORS(sample)[ALIGN((sample)->colors, 2)])
+#define AGGREGATE_SAMPLE_SIZE(sets, colors, count)			\
+	(sizeof(struct aggregate_sample) + ALIGN((sets), 8) +		\
+	 ALIGN((colors), 2) * sizeof(uint32_t) +			\
+	 (count) * sizeof(struct aggregate_owner))
+
+/* Past this many owners, lines are accounted to AGGREGATE_ID_OTHER */
+#define MAX_AGGREGATE_OWNERS 256
+#define AGGREGATE_ID_OTHER   (~0U)
+
+/* RAMINDEX RAM identifiers, see 4.3.64 in the ARM Cortex-A57 MPCore
+ * Processor Technical Reference Manual */
+#define RAMID_L1I_TAG        0x00
+#define RAMID_L1D_TAG        0x08
+#define RAMID_L1D_TLB        0x0a
+#define RAMID_L2_TAG         0x10
+#define RAMID_L2_TLB         0x18
+
+#define RAMINDEX(ramid, way, index)					\
+	(((ramid) << 24) | ((way) << 18) | (index))
+
+/* Private arrays of an A57 core */
+#define L1D_SETS             256
+#define L1D_WAYS             2
+#define L1I_SETS             256
+#define L1I_WAYS             3
+#define L1D_TLB_ENTRIES      32
+#define L2_TLB_SETS          256
+#define L2_TLB_WAYS          4
+
+/* At most this many cores share the L2 */
+#define MAX_CLUSTER_CPUS     4
+
+/* Raw content of the private arrays of one core, as returned by the
+ * DL1DATAn_EL1 registers. Tags are stored as DATA1:DATA0, TLB
+ * entries as DATA1:DATA0 followed by DATA3:DATA2. Decoding is left
+ * to user space. */
+struct core_sample
+{
+	uint32_t cpu;		/* CPU the arrays belong to, ~0 if unused */
+	uint32_t reserved;
+	uint64_t l1d_tags[L1D_SETS * L1D_WAYS];
+	uint64_t l1i_tags[L1I_SETS * L1I_WAYS];
+	uint64_t l1d_tlb[L1D_TLB_ENTRIES * 2];
+	uint64_t l2_tlb[L2_TLB_SETS * L2_TLB_WAYS * 2];
+};
+
+/* The core section is appended to samples in any format */
+#define CORE_SECTION_SIZE (MAX_CLUSTER_CPUS * sizeof(struct core_sample))
+#define CORE_SECTION_MAX_SIZE						\
+	((flags & DUMPCACHE_CMD_CORES_EN_SHIFT) ? CORE_SECTION_SIZE : 0)
+
+/* Pid reported for the lines whose owner could not be found */
+#define RMAP_FAILED_PID      ((pid_t)99999)
+
+/* Per-CPU entries of the timing section */
+#define MAX_STALL_CPUS       8
+
+/* Timing of a snapshot. Timestamps and durations are in ticks of the
+ * architected timer, which runs at freq Hz. The start and end are also
+ * given as CLOCK_MONOTONIC, to line samples up with user space. */
+struct sample_timing
+{
+	uint64_t start;		/* Before the other CPUs are interrupted */
+	uint64_t end;		/* Once the sample is complete */
+	uint64_t start_ns;	/* Start, as CLOCK_MONOTONIC in ns */
+	uint64_t end_ns;	/* End, as CLOCK_MONOTONIC in ns */
+	uint32_t freq;
+	uint32_t cpu;		/* CPU that took the snapshot */
+	uint32_t stall[MAX_STALL_CPUS];	/* From start to each CPU stalling, ~0 if not */
+	uint32_t dump;		/* Reading the tags, inline resolution included */
+	uint32_t resolve;	/* Deferred resolution, 0 if not deferred */
+	uint32_t valid;		/* Valid lines in the selection */
+	uint32_t rmap_failures;	/* Valid lines resolved to RMAP_FAILED_PID */
+};
+
+/* The timing section follows the core section, if any */
+#define TIMING_SECTION_SIZE (sizeof(struct sample_timing))
+#define TIMING_SECTION_MAX_SIZE						\
+	((flags & DUMPCACHE_CMD_TIMESTAMP_EN_SHIFT) ? TIMING_SECTION_SIZE : 0)
+
+/* Running totals of the PMU counters of each CPU, read by the CPU
+ * itself as it enters the stall. Totals of CPUs whose counters could
+ * not be read are ~0. */
+struct pmu_sample
+{
+	uint32_t events[MAX_PMU_EVENTS];
+	uint64_t counts[MAX_STALL_CPUS][MAX_PMU_EVENTS];
+};
+
+/* The PMU section sits between the core and timing sections */
+#define PMU_SECTION_SIZE (sizeof(struct pmu_sample))
+#define PMU_SECTION_MAX_SIZE						\
+	((flags & DUMPCACHE_CMD_PMU_EN_SHIFT) ? PMU_SECTION_SIZE : 0)
+
+#define SECTIONS_MAX_SIZE						\
+	(CORE_SECTION_MAX_SIZE + PMU_SECTION_MAX_SIZE + TIMING_SECTION_MAX_SIZE)
+
+#define PACKED_SAMPLE_MAX_SIZE						\
+	(PACKED_SAMPLE_SIZE(geom.sets, geom.sets * geom.ways) +		\
+	 OTHER_SECTION_MAX_SIZE + KERNEL_SECTION_MAX_SIZE + SECTIONS_MAX_SIZE)
+#define DELTA_SAMPLE_MAX_SIZE						\
+	(DELTA_SAMPLE_SIZE(geom.sets * geom.ways) +			\
+	 OTHER_SECTION_MAX_SIZE + KERNEL_SECTION_MAX_SIZE + SECTIONS_MAX_SIZE)
+#define AGGREGATE_SAMPLE_MAX_SIZE					\
+	(AGGREGATE_SAMPLE_SIZE(geom.sets, geom.sets / AGGREGATE_COLOR_SETS, \
+			       MAX_AGGREGATE_OWNERS) + SECTIONS_MAX_SIZE)
+
+/* Default number of samples between two keyframes in delta mode */
+#define DELTA_KEYFRAME_PERIOD 100
+
+/* Sets are handed out in chunks to the CPUs taking part in a
+ * parallel dump */
+#define DUMP_CHUNK_SETS 64
+#define DUMP_CHUNKS (geom.sets / DUMP_CHUNK_SETS)
+#define MAX_DUMP_CHUNKS (MAX_CACHESETS / DUMP_CHUNK_SETS)
+
+/* The lines of a 4 KB page all fall in the same chunk of sets, so
+ * the owners of the pages resolved during a snapshot are memoized in
+ * one open-addressing table per chunk. Tables are sized to twice the
+ * lines in a chunk and are only ever touched by the CPU dumping that
+ * chunk. Keys carry the snapshot generation, so that stale entries
+ * need no clearing. */
+#define MEMO_BITS 11
+#define MEMO_SLOTS (1 << MEMO_BITS)
+
+struct pfn_memo
+{
+	uint64_t key;		/* | 63..32 generation | 31..0 pfn | */
+	uint64_t owner;		/* | 63..20 page vaddr >> 12 | 19..0 pid | */
+};
+
+#define MEMO_KEY(gen, pfn)    (((uint64_t)(gen) << 32) | ((pfn) & 0xffffffffUL))
+#define MEMO_KEY_GEN(key)     ((u32)((key) >> 32))
+#define MEMO_OWNER(pid, addr)						\
+	((((uint64_t)(addr) >> PAGE_SHIFT) << PACKED_PID_BITS) | ((uint64_t)(pid) & PACKED_PID_MASK))
+#define MEMO_OWNER_PID(owner) ((pid_t)((owner) & PACKED_PID_MASK))
+#define MEMO_OWNER_ADDR(owner) (((owner) >> PACKED_PID_BITS) << PAGE_SHIFT)
+
+/* Owners of a summary are counted in an open-addressing table twice
+ * as large as the number of entries it can hold */
+#define AGGREGATE_BITS 9
+#define AGGREGATE_SLOTS (1 << AGGREGATE_BITS)
+
+/* Same for the pages listed in the kernel section */
+#define KERNEL_PAGE_BITS 9
+#define KERNEL_PAGE_SLOTS (1 << KERNEL_PAGE_BITS)
+
+/* Module state that must not pollute the cache under observation
+ * while it is updated. It lives at the end of aperture 2. */
+struct dumpcache_scratch
 {
-	struct cache_line cachelines[16];
+	/* Last recorded content of each (set, way), in packed form */
+	uint64_t shadow[MAX_CACHESETS * MAX_WAYS];
+	/* Content of each (set, way) captured by the ongoing snapshot */
+	uint64_t capture[MAX_CACHESETS * MAX_WAYS];
+	/* Owners of the pages resolved by the ongoing snapshot */
+	struct pfn_memo memo[MAX_DUMP_CHUNKS][MEMO_SLOTS];
+	/* Private arrays of the cores captured by the ongoing snapshot */
+	struct core_sample cores[MAX_CLUSTER_CPUS];
+	/* Timing of the ongoing snapshot, stall latencies in particular */
+	struct sample_timing timing;
+	/* PMU counters read by each CPU entering the stall */
+	struct pmu_sample pmu;
 };
 
-struct cache_sample {
-	struct cache_set sets[CACHESETS_TO_WRITE];
+/* Work handed to the other CPUs of the cluster during a snapshot */
+struct dump_job
+{
+	atomic_t next;		/* Next chunk to be claimed */
+	atomic_t pending;	/* Chunks not dumped yet */
+	atomic_t valid;		/* Valid lines found in the dumped chunks */
+	int base;		/* First set of the first chunk */
+	int chunks;		/* Chunks covering the selection, 0 if not parallel */
+	atomic_t next_core;	/* Next free slot in the core section */
+	atomic_t cores_pending;	/* Cores yet to capture their private arrays */
+	bool cores;		/* Whether to capture private arrays */
 };
 
 /* Global variables */
@@ -75,8 +554,17 @@ struct cache_sample {
 #define CACHE_BUF_SIZE1 (CACHE_BUF_END1 - CACHE_BUF_BASE1)
 #define CACHE_BUF_SIZE2 (CACHE_BUF_END2 - CACHE_BUF_BASE2)
 
-#define CACHE_BUF_COUNT1 (CACHE_BUF_SIZE1 / sizeof(struct cache_sample))
-#define CACHE_BUF_COUNT2 (CACHE_BUF_SIZE2 / sizeof(struct cache_sample))
+#define CACHE_SCRATCH_SIZE PAGE_ALIGN(sizeof(struct dumpcache_scratch))
+
+#define CACHE_BUF_COUNT1 (CACHE_BUF_SIZE1 / sample_size)
+#define CACHE_BUF_COUNT2 ((CACHE_BUF_SIZE2 - CACHE_SCRATCH_SIZE) / sample_size)
+
+/* Part of each aperture actually used to store samples. The two
+ * parts are seen as one contiguous range of offsets, aperture 1
+ * first, both by the mmap interface and by the packed format. */
+#define CACHE_BUF_LEN1 (CACHE_BUF_COUNT1 * sample_size)
+#define CACHE_BUF_LEN2 (CACHE_BUF_COUNT2 * sample_size)
+#define CACHE_RING_LEN (CACHE_BUF_LEN1 + CACHE_BUF_LEN2)
 
 #define DUMPCACHE_CMD_VALUE_WIDTH  16 
 #define DUMPCACHE_CMD_VALUE_MASK   ((1 << DUMPCACHE_CMD_VALUE_WIDTH) - 1)
@@ -101,17 +589,148 @@ struct cache_sample {
 #define DUMPCACHE_CMD_TIMESTAMP_EN_SHIFT       (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 7))
 #define DUMPCACHE_CMD_TIMESTAMP_DIS_SHIFT      (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 8))
 
+/* Command to enable/disable the packed sample format */
+#define DUMPCACHE_CMD_PACKED_EN_SHIFT        (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 9))
+#define DUMPCACHE_CMD_PACKED_DIS_SHIFT       (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 10))
+
+/* Command to enable/disable delta encoding between samples */
+#define DUMPCACHE_CMD_DELTA_EN_SHIFT         (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 11))
+#define DUMPCACHE_CMD_DELTA_DIS_SHIFT        (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 12))
+
+/* Command to enable/disable tag extraction on all the CPUs sharing
+ * the L2 */
+#define DUMPCACHE_CMD_PARALLEL_EN_SHIFT      (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 13))
+#define DUMPCACHE_CMD_PARALLEL_DIS_SHIFT     (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 14))
+
+/* Command to enable/disable deferring address resolution until the
+ * other CPUs have been released */
+#define DUMPCACHE_CMD_DEFER_EN_SHIFT         (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 15))
+#define DUMPCACHE_CMD_DEFER_DIS_SHIFT        (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 16))
+
+/* Command to enable/disable the capture of the L1 and TLBs of the
+ * cores sharing the L2 */
+#define DUMPCACHE_CMD_CORES_EN_SHIFT         (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 17))
+#define DUMPCACHE_CMD_CORES_DIS_SHIFT        (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 18))
+
+/* Command to enable/disable reading the PMU counters of every CPU
+ * with each snapshot */
+#define DUMPCACHE_CMD_PMU_EN_SHIFT           (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 19))
+#define DUMPCACHE_CMD_PMU_DIS_SHIFT          (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 20))
+
+/* Command to enable/disable storing occupancy summaries instead of
+ * the lines */
+#define DUMPCACHE_CMD_AGGREGATE_EN_SHIFT     (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 21))
+#define DUMPCACHE_CMD_AGGREGATE_DIS_SHIFT    (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 22))
+
+/* Command to enable/disable counting lines per cgroup rather than per
+ * process in summaries */
+#define DUMPCACHE_CMD_AGG_CGROUPS_EN_SHIFT   (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 23))
+#define DUMPCACHE_CMD_AGG_CGROUPS_DIS_SHIFT  (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 24))
+
+/* Command to enable/disable classifying the lines of pages that no
+ * process maps */
+#define DUMPCACHE_CMD_CLASSIFY_EN_SHIFT      (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 25))
+#define DUMPCACHE_CMD_CLASSIFY_DIS_SHIFT     (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 26))
+
+/* Resolution is deferred only if requested at all. It has to be
+ * when some CPUs are not stalled: only the deferred resolver takes
+ * the rmap locks. */
+#define DUMPCACHE_RESOLVE_DEFERRED(flags)				\
+	(((flags) & DUMPCACHE_CMD_RESOLVE_EN_SHIFT) &&			\
+	 (((flags) & DUMPCACHE_CMD_DEFER_EN_SHIFT) || stall.policy != STALL_POLICY_ALL))
+
+/* Formats that store variable-size records back to back */
+#define DUMPCACHE_RECORD_FORMATS					\
+	(DUMPCACHE_CMD_PACKED_EN_SHIFT | DUMPCACHE_CMD_DELTA_EN_SHIFT |	\
+	 DUMPCACHE_CMD_AGGREGATE_EN_SHIFT)
+
+/* Flags that change the lines deltas are computed on */
+#define DUMPCACHE_DELTA_FLAGS						\
+	(DUMPCACHE_RECORD_FORMATS | DUMPCACHE_CMD_RESOLVE_EN_SHIFT |	\
+	 DUMPCACHE_CMD_CLASSIFY_EN_SHIFT)
+
 static uint32_t cur_buf = 0;
 static unsigned long flags;
 
+/* Geometry of the L2, and size of a sample in the full format with
+ * and without the sections. The lines are followed by a header. */
+static struct cache_geometry geom;
+static size_t sample_size;
+static size_t l2_sample_size;
+
+/* Part of the L2 to capture */
+static struct dump_selection sel;
+
+#define ALL_WAYS ((1U << geom.ways) - 1)
+#define SEL_HAS_WAY(way) (sel.way_mask & (1U << (way)))
+
 /* Beginning of cache buffer in aperture 1 */
-static struct cache_sample * __buf_start1 = NULL;
+static void * __buf_start1 = NULL;
 
 /* Beginning of cache buffer in aperture 2 */
-static struct cache_sample * __buf_start2 = NULL;
+static void * __buf_start2 = NULL;
 
 /* Pointer to buffer currently in use. */
-static struct cache_sample * cur_sample = NULL;
+static struct cache_line * cur_sample = NULL;
+
+/* Offset of the record currently in use in packed mode */
+static unsigned long cur_off = 0;
+
+/* Uncached scratch area at the end of aperture 2 */
+static struct dumpcache_scratch * __scratch = NULL;
+
+/* Samples between keyframes, and samples left before the next one */
+static unsigned long keyframe_period = DELTA_KEYFRAME_PERIOD;
+static unsigned long keyframe_countdown = 0;
+
+/* Generation of the page owners memoized in the scratch area */
+static u32 memo_gen = 1;
+
+/* Owners counted while summarizing a snapshot, per process and then
+ * per cgroup. Unlike the scratch area, these are cached: they are
+ * small and only used once the other CPUs have been released. */
+static struct aggregate_owner agg_tables[2][AGGREGATE_SLOTS];
+
+/* Index in the kernel section of each page listed so far, plus one */
+static struct kernel_page_slot
+{
+	unsigned long pfn;
+	uint32_t entry;
+} kernel_page_slots[KERNEL_PAGE_SLOTS];
+
+/* In autoinc mode the buffers are a single-producer/single-consumer
+ * ring. Snapshots are stored at the head (cur_buf or cur_off) and
+ * released by the consumer from the tail. A snapshot that does not
+ * fit is dropped rather than overwriting unconsumed samples. */
+struct sample_ring
+{
+	unsigned long tail;	/* Offset of the oldest unconsumed sample */
+	unsigned long fill;	/* Bytes from tail to head, padding included */
+	uint32_t pending;	/* Samples stored and not consumed yet */
+	uint32_t overruns;	/* Samples dropped because the ring was full */
+};
+
+static struct sample_ring ring;
+static DEFINE_SPINLOCK(ring_lock);
+static DECLARE_WAIT_QUEUE_HEAD(ring_wait);
+
+/* Serializes snapshots and configuration changes between user space
+ * and the periodic sampler */
+static DEFINE_MUTEX(snapshot_mutex);
+
+/* In-kernel periodic sampler, if running. Starting and stopping it
+ * is serialized by sampler_mutex. */
+static struct task_struct * sampler_task = NULL;
+static u64 sampler_period_ns;
+static DEFINE_MUTEX(sampler_mutex);
+
+/* Event-driven sampler, if running, with the counter that wakes it
+ * up and the overflows it has not served yet. Also serialized by
+ * sampler_mutex. The sampler pauses the counter during snapshots:
+ * the counter only changes under snapshot_mutex too. */
+static struct task_struct * trigger_task = NULL;
+static struct perf_event * trigger_counter = NULL;
+static atomic_t trigger_pending;
 
 //static struct vm_area_struct *cache_set_buf_vma;
 static int dump_all_indices_done;
@@ -119,13 +738,82 @@ static int dump_all_indices_done;
 //spinlock_t snap_lock = SPIN_LOCK_UNLOCK;
 static DEFINE_SPINLOCK(snap_lock);
 
+static struct dump_job dump_job;
+
+/* Which CPUs to stall, and which ones the last snapshot stalled */
+static struct stall_policy stall;
+static u8 stalled_cpus;
+
+/* Processes under observation. References are held so that pids
+ * cannot be reused under our feet. */
+static struct pid * targets[MAX_TARGETS];
+static pid_t target_nrs[MAX_TARGETS];
+static int target_count = 0;
+
+/* Filter applied while resolving, and the cgroup it refers to */
+static struct dump_filter filter;
+static struct cgroup * filter_cgroup = NULL;
+
+/* Start of the ongoing snapshot, and lines that failed resolution */
+static u64 snap_start;
+static atomic_t rmap_failures;
+
+/* Dump loops specialized for the number of ways of the L2 */
+struct dump_loops
+{
+	/* Capture raw or resolved lines into the scratch area */
+	int (*capture)(int first, int last);
+	/* Dump unresolved lines straight into the current sample */
+	int (*noresolve)(int first, int last);
+};
+
+static const struct dump_loops * loops = NULL;
+
+/* Events counted with each snapshot: L2 refills and write-backs, L1D
+ * refills, retired instructions and cycles by default */
+static uint32_t pmu_events[MAX_PMU_EVENTS] = {
+	0x17, 0x18, 0x03, 0x08, 0x11, PMU_EVENT_NONE
+};
+
+/* In-kernel counters of each CPU, NULL where they could not be set
+ * up */
+static struct perf_event * pmu_counters[MAX_STALL_CPUS][MAX_PMU_EVENTS];
+
 static bool rmap_one_func(struct page *page, struct vm_area_struct *vma, unsigned long addr, void *arg);
 static void (*rmap_walk_func) (struct page *page, struct rmap_walk_control *rwc) = NULL;
 
+/* Largest pid plus one, which must stay below the pseudo-pids of
+ * packed lines */
+static int * pid_max_ptr = NULL;
+
+/* Same walk, taking the anon_vma or i_mmap lock: needed whenever
+ * other CPUs run, and may unmap or free the VMAs being walked */
+static void (*rmap_walk_locking_func) (struct page *page, struct rmap_walk_control *rwc) = NULL;
+
+/* Not exported, but the only way to read a counter with interrupts
+ * disabled */
+static u64 (*perf_read_local_func) (struct perf_event *event) = NULL;
+
 /* Function prototypes */
 static int dumpcache_open (struct inode *inode, struct file *filp);
-static int dump_index(int index, struct cache_set* buf);
+static int dumpcache_mmap (struct file *filp, struct vm_area_struct *vma);
 static int dump_all_indices(void);
+static int dump_sets(int first, int last);
+static void dump_chunks(struct dump_job * job);
+static void encode_packed(struct packed_sample * sample, uint64_t * shadow);
+static void encode_delta(struct delta_sample * sample);
+static void encode_aggregate(struct aggregate_sample * sample);
+static void fill_full_hdr(struct cache_line * sample, uint32_t valid);
+static void resolve_capture(void);
+static void expand_capture(struct cache_line * sample);
+static void capture_core(struct dump_job * job);
+static void append_cores(void * dst);
+static void append_timing(void * dst);
+static void read_pmu(int cpu);
+static void restrict_stall(struct cpumask * mask);
+static void record_stalled(int self, const struct cpumask * stalled,
+			   const struct cpumask * workers);
+static void append_pmu(void * dst);
 
 static void *c_start(struct seq_file *m, loff_t *pos)
 {
@@ -142,20 +830,59 @@ static void c_stop(struct seq_file *m, void *v) {}
 
 void cpu_stall (void * info)
 {
-	(void)info;
+	struct dump_job * job = info;
+	int cpu = smp_processor_id();
+
+	/* Time it took for the IPI to get here */
+	if ((flags & DUMPCACHE_CMD_TIMESTAMP_EN_SHIFT) && cpu < MAX_STALL_CPUS)
+		__scratch->timing.stall[cpu] = arch_counter_get_cntvct() - snap_start;
+
+	if (flags & DUMPCACHE_CMD_PMU_EN_SHIFT)
+		read_pmu(cpu);
+
+	/* Save the private arrays before the dump code pollutes them,
+	 * then help with the dump, if asked to */
+	if (job && job->cores)
+		capture_core(job);
+
+	if (job && job->chunks)
+		dump_chunks(job);
+	
 	spin_lock(&snap_lock);
 	spin_unlock(&snap_lock);
 }
 
+static inline void * buf_from_offset(unsigned long off);
+
+static inline bool record_valid(struct sample_hdr * hdr)
+{
+	return hdr && (hdr->magic == SAMPLE_MAGIC_PACKED ||
+		       hdr->magic == SAMPLE_MAGIC_DELTA ||
+		       hdr->magic == SAMPLE_MAGIC_AGGREGATE);
+}
+
 static int c_show(struct seq_file *m, void *v)
 {
+	void * record = cur_sample;
+	size_t size = sample_size;
+
+	/* With variable-size records, output the current one, if any */
+	if (flags & DUMPCACHE_RECORD_FORMATS) {
+		struct sample_hdr * hdr = buf_from_offset(cur_off);
+
+		if (!record_valid(hdr))
+			return 0;
 
+		record = hdr;
+		size = hdr->size;
+	}
+	
 	/* Make sure that the buffer has the right size */
-	m->size = sizeof(struct cache_sample) + 32;
-	m->buf = kvmalloc(sizeof(struct cache_sample) + 32, GFP_KERNEL);;
+	m->size = sample_size + 32;
+	m->buf = kvmalloc(sample_size + 32, GFP_KERNEL);;
 	
 	/* Read buffer into sequential file interface */
-	if (seq_write(m, cur_sample, sizeof(struct cache_sample)) != 0) {
+	if (seq_write(m, record, size) != 0) {
 		pr_info("Seq write returned non-zero value\n");
 	}
 
@@ -164,45 +891,441 @@ static int c_show(struct seq_file *m, void *v)
 
 /* This function returns a pointr to the ind-th sample in the
  * buffer. */
-static inline struct cache_sample * sample_from_index(uint32_t ind)
+static inline struct cache_line * sample_from_index(uint32_t ind)
 {
 	if (ind < CACHE_BUF_COUNT1)
-		return &__buf_start1[ind];
+		return (struct cache_line *)((char *)__buf_start1 + ind * sample_size);
 
 	else if (ind < CACHE_BUF_COUNT1 + CACHE_BUF_COUNT2)
-		return &__buf_start2[ind - CACHE_BUF_COUNT1];
+		return (struct cache_line *)((char *)__buf_start2 +
+					     (ind - CACHE_BUF_COUNT1) * sample_size);
+
+	else
+		return NULL;
+}
+
+/* This function returns a pointer to the byte at offset off in the
+ * buffers. */
+static inline void * buf_from_offset(unsigned long off)
+{
+	if (off < CACHE_BUF_LEN1)
+		return (char *)__buf_start1 + off;
+
+	else if (off < CACHE_BUF_LEN1 + CACHE_BUF_LEN2)
+		return (char *)__buf_start2 + (off - CACHE_BUF_LEN1);
+
+	else
+		return NULL;
+}
+
+/* Walk the packed records from the beginning of the buffers to find
+ * the offset of the ind-th one. */
+static long offset_from_index(uint32_t ind)
+{
+	unsigned long off = 0;
+	struct sample_hdr * hdr;
+
+	while (off < CACHE_BUF_LEN1 + CACHE_BUF_LEN2) {
+		hdr = buf_from_offset(off);
+
+		if (hdr->magic == SAMPLE_MAGIC_PAD) {
+			off += hdr->size;
+			continue;
+		}
+
+		if (ind == 0)
+			return off;
+
+		if (!record_valid(hdr))
+			break;
+
+		off += hdr->size;
+		--ind;
+	}
+
+	return -ENOMEM;
+}
+
+/* Reset the ring so that the next sample is stored at offset head */
+static void ring_reset(unsigned long head)
+{
+	struct sample_hdr * hdr = buf_from_offset(head);
+
+	/* The buffers outlive the module and its settings: what lies
+	 * past the head must not be taken for records of this run */
+	if (hdr)
+		hdr->magic = 0;
+
+	/* Readers start at the head, where a delta would refer to a
+	 * sample they never see */
+	keyframe_countdown = 0;
+
+	spin_lock(&ring_lock);
+	ring.tail = head;
+	ring.fill = 0;
+	ring.pending = 0;
+	ring.overruns = 0;
+	spin_unlock(&ring_lock);
+}
+
+/* Claim size bytes past the head, of which skip are padding. Fails
+ * and accounts for an overrun if the consumer is lagging behind. */
+static bool ring_reserve(unsigned long size, unsigned long skip)
+{
+	bool ok = true;
+
+	spin_lock(&ring_lock);
+	if (ring.fill + skip + size > CACHE_RING_LEN) {
+		++ring.overruns;
+		ok = false;
+	} else {
+		ring.fill += skip;
+	}
+	spin_unlock(&ring_lock);
+
+	return ok;
+}
+
+/* Publish a sample of size bytes stored at the head */
+static void ring_commit(unsigned long size)
+{
+	spin_lock(&ring_lock);
+	ring.fill += size;
+	++ring.pending;
+	spin_unlock(&ring_lock);
+
+	wake_up_interruptible(&ring_wait);
+}
+
+/* Release the count oldest samples, along with any padding in
+ * between. Returns the number of samples released. */
+static long ring_consume(unsigned long count)
+{
+	struct sample_hdr * hdr;
+	unsigned long size;
+	long done = 0;
+
+	spin_lock(&ring_lock);
+	while (done < count && ring.pending) {
+		if (ring.tail >= CACHE_RING_LEN)
+			ring.tail = 0;
+
+		size = sample_size;
+		if (flags & DUMPCACHE_RECORD_FORMATS) {
+			hdr = buf_from_offset(ring.tail);
+			size = hdr->size;
+
+			if (hdr->magic != SAMPLE_MAGIC_PAD) {
+				--ring.pending;
+				++done;
+			}
+		} else {
+			--ring.pending;
+			++done;
+		}
+
+		ring.tail += size;
+		ring.fill -= size;
+	}
+
+	if (ring.tail >= CACHE_RING_LEN)
+		ring.tail = 0;
+	spin_unlock(&ring_lock);
+
+	return done;
+}
 
+static void ring_get_status(struct ring_status * status)
+{
+	spin_lock(&ring_lock);
+	if (flags & DUMPCACHE_RECORD_FORMATS)
+		status->head = cur_off;
 	else
+		status->head = (uint64_t)cur_buf * sample_size;
+	status->tail = ring.tail;
+	status->len = CACHE_RING_LEN;
+	status->pending = ring.pending;
+	status->overruns = ring.overruns;
+	spin_unlock(&ring_lock);
+}
+
+/* Make room for a variable-size record of up to max_size bytes at
+ * cur_off. Records never straddle the two apertures: the tail of
+ * aperture 1, or of the ring when wrapping around, is skipped with a
+ * pad record if needed. Returns NULL if the ring is full. */
+static void * reserve_record(unsigned long max_size)
+{
+	struct sample_hdr * pad;
+	unsigned long skip = 0;
+	bool wrap = false;
+
+	if (cur_off + max_size > CACHE_RING_LEN) {
+		skip = CACHE_RING_LEN - cur_off;
+		wrap = true;
+	} else if (cur_off < CACHE_BUF_LEN1 && cur_off + max_size > CACHE_BUF_LEN1) {
+		skip = CACHE_BUF_LEN1 - cur_off;
+	}
+
+	/* Never overwrite what the consumer has not released */
+	if ((flags & DUMPCACHE_CMD_AUTOINC_EN_SHIFT) && !ring_reserve(max_size, skip))
 		return NULL;
+
+	if (skip) {
+		/* Only the first 8 bytes are guaranteed to fit */
+		pad = buf_from_offset(cur_off);
+		pad->magic = SAMPLE_MAGIC_PAD;
+		pad->size = skip;
+		cur_off += skip;
+	}
+
+	/* Older keyframes are about to be overwritten */
+	if (wrap) {
+		cur_off = 0;
+		cur_buf = 0;
+		keyframe_countdown = 0;
+	}
+
+	return buf_from_offset(cur_off);
 }
 
 static int acquire_snapshot(void)
 {
 	int processor_id;
 	struct cpumask cpu_mask;
+	struct cpumask worker_mask;
+	struct dump_job * job = NULL;
+	struct sample_hdr * record = NULL;
+	struct sample_timing * timing = NULL;
+	bool delta = false;
+	u64 dump_start = 0, resolve_start;
+	int valid;
+
+	/* Variable-size records must be placed before stalling.
+	 * Summaries take precedence over the other formats. */
+	if (flags & DUMPCACHE_CMD_AGGREGATE_EN_SHIFT) {
+		record = reserve_record(AGGREGATE_SAMPLE_MAX_SIZE);
+	} else if (flags & DUMPCACHE_CMD_DELTA_EN_SHIFT) {
+		record = reserve_record(DELTA_SAMPLE_MAX_SIZE);
+
+		/* Deltas need the previous sample to be kept around */
+		delta = (keyframe_countdown > 0 &&
+			 (flags & DUMPCACHE_CMD_AUTOINC_EN_SHIFT));
+	} else if (flags & DUMPCACHE_CMD_PACKED_EN_SHIFT) {
+		record = reserve_record(PACKED_SAMPLE_MAX_SIZE);
+	} else if (flags & DUMPCACHE_CMD_AUTOINC_EN_SHIFT) {
+		if (!ring_reserve(sample_size, 0))
+			return 0;
+	}
+
+	/* The ring is full: drop this snapshot. The shadow is left
+	 * untouched, so the next delta is still consistent. */
+	if ((flags & DUMPCACHE_RECORD_FORMATS) && !record)
+		return 0;
+
+	/* Forget the pages resolved by the previous snapshot */
+	if (++memo_gen == 0) {
+		memset_io(__scratch->memo, 0, sizeof(__scratch->memo));
+		memo_gen = 1;
+	}
 	
 	/* Prepare cpu mask with all CPUs except current one */
 	processor_id = get_cpu();
 	cpumask_copy(&cpu_mask, cpu_online_mask);
 	cpumask_clear_cpu(processor_id, &cpu_mask); //processor_id, &cpu_mask);
+
+	/* Only the CPUs in our cluster share the L2 and implement the
+	 * same RAMINDEX interface: those help with the dump and save
+	 * their private arrays, the others just stall. */
+	if (flags & (DUMPCACHE_CMD_PARALLEL_EN_SHIFT | DUMPCACHE_CMD_CORES_EN_SHIFT)) {
+		cpumask_and(&worker_mask, &cpu_mask, topology_core_cpumask(processor_id));
+		cpumask_andnot(&cpu_mask, &cpu_mask, &worker_mask);
+
+		job = &dump_job;
+		job->chunks = 0;
+		job->cores = !!(flags & DUMPCACHE_CMD_CORES_EN_SHIFT);
+	}
+
+	/* Spare the CPUs left out by the policy. Helpers of parallel
+	 * dumps and core captures are interrupted anyway. */
+	restrict_stall(&cpu_mask);
+	record_stalled(processor_id, &cpu_mask, job ? &worker_mask : NULL);
+
+	if (flags & DUMPCACHE_CMD_PARALLEL_EN_SHIFT) {
+		/* Chunks stay aligned to DUMP_CHUNK_SETS, so that no two
+		 * CPUs share a memo table */
+		job->base = round_down(sel.first_set, DUMP_CHUNK_SETS);
+		job->chunks = DIV_ROUND_UP(sel.last_set - job->base, DUMP_CHUNK_SETS);
+		atomic_set(&job->next, 0);
+		atomic_set(&job->pending, job->chunks);
+		atomic_set(&job->valid, 0);
+	}
+
+	if (job && job->cores) {
+		int i;
+		
+		for (i = 0; i < MAX_CLUSTER_CPUS; i++)
+			__scratch->cores[i].cpu = ~0U;
+		
+		atomic_set(&job->next_core, 0);
+		atomic_set(&job->cores_pending, cpumask_weight(&worker_mask) + 1);
+	}
+	
+	if (flags & DUMPCACHE_CMD_TIMESTAMP_EN_SHIFT) {
+		int i;
+
+		timing = &__scratch->timing;
+		for (i = 0; i < MAX_STALL_CPUS; i++)
+			timing->stall[i] = ~0U;
+		if (processor_id < MAX_STALL_CPUS)
+			timing->stall[processor_id] = 0;
+
+		atomic_set(&rmap_failures, 0);
+		timing->cpu = processor_id;
+		timing->freq = arch_timer_get_cntfrq();
+		snap_start = arch_counter_get_cntvct();
+		timing->start = snap_start;
+		timing->start_ns = ktime_get_ns();
+		wmb();
+	}
+	
+	/* Counters of the CPUs that do not stall are reported as ~0 */
+	if (flags & DUMPCACHE_CMD_PMU_EN_SHIFT) {
+		memset_io(__scratch->pmu.counts, 0xff, sizeof(__scratch->pmu.counts));
+		wmb();
+	}
 	
 	/* Acquire lock to spin other CPUs */
 	spin_lock(&snap_lock);
 	preempt_disable();
+
+	/* Our counters are read at about the same time as those of
+	 * the other CPUs: the dump itself is accounted to the next
+	 * interval */
+	if (flags & DUMPCACHE_CMD_PMU_EN_SHIFT)
+		read_pmu(processor_id);
 	
 	/* Critical section! */
 	on_each_cpu_mask(&cpu_mask, cpu_stall, NULL, 0);
 
+	if (timing)
+		dump_start = arch_counter_get_cntvct();
+
 	/* Perform cache snapshot */
-	dump_all_indices();
+	if (job) {
+		on_each_cpu_mask(&worker_mask, cpu_stall, job, 0);
+
+		if (job->cores)
+			capture_core(job);
+	}
+	
+	if (job && job->chunks) {
+		dump_chunks(job);
+
+		/* Wait for the chunks claimed by the other CPUs */
+		while (atomic_read(&job->pending))
+			cpu_relax();
+		rmb();
+		valid = atomic_read(&job->valid);
+	} else {
+		valid = dump_all_indices();
+	}
+
+	/* The core section must be complete before releasing */
+	if (job && job->cores) {
+		while (atomic_read(&job->cores_pending))
+			cpu_relax();
+		rmb();
+	}
+	
+	if (timing)
+		timing->dump = arch_counter_get_cntvct() - dump_start;
 	
 	preempt_enable();
 	spin_unlock(&snap_lock);
 	put_cpu();
 
+	/* Only now resolve the lines, if that was deferred */
+	if (DUMPCACHE_RESOLVE_DEFERRED(flags)) {
+		resolve_start = arch_counter_get_cntvct();
+		resolve_capture();
+
+		if (!record)
+			expand_capture(cur_sample);
+
+		if (timing)
+			timing->resolve = arch_counter_get_cntvct() - resolve_start;
+	} else if (timing) {
+		timing->resolve = 0;
+	}
+
+	/* Encode variable-size records out of the captured lines */
+	if (flags & DUMPCACHE_CMD_AGGREGATE_EN_SHIFT)
+		encode_aggregate((struct aggregate_sample *)record);
+	else if (delta)
+		encode_delta((struct delta_sample *)record);
+	else if (flags & DUMPCACHE_CMD_DELTA_EN_SHIFT)
+		encode_packed((struct packed_sample *)record, __scratch->shadow);
+	else if (record)
+		encode_packed((struct packed_sample *)record, NULL);
+	else
+		fill_full_hdr(cur_sample, valid);
+
+	if ((flags & DUMPCACHE_CMD_DELTA_EN_SHIFT) &&
+	    !(flags & DUMPCACHE_CMD_AGGREGATE_EN_SHIFT)) {
+		if (delta)
+			--keyframe_countdown;
+		else
+			keyframe_countdown = keyframe_period - 1;
+	}
+
+	/* Append the private arrays of the cores */
+	if (flags & DUMPCACHE_CMD_CORES_EN_SHIFT) {
+		if (record) {
+			append_cores((char *)record + record->size);
+			record->size += CORE_SECTION_SIZE;
+			record->flags |= SAMPLE_FLAG_CORES;
+		} else {
+			append_cores((char *)cur_sample + l2_sample_size);
+		}
+	}
+
+	/* Then the PMU counters */
+	if (flags & DUMPCACHE_CMD_PMU_EN_SHIFT) {
+		if (record) {
+			append_pmu((char *)record + record->size);
+			record->size += PMU_SECTION_SIZE;
+			record->flags |= SAMPLE_FLAG_PMU;
+		} else {
+			append_pmu((char *)cur_sample + l2_sample_size + CORE_SECTION_MAX_SIZE);
+		}
+	}
+
+	/* Then the timing section, which closes the sample */
+	if (timing) {
+		timing->valid = valid;
+		timing->rmap_failures = atomic_read(&rmap_failures);
+		timing->end = arch_counter_get_cntvct();
+		timing->end_ns = ktime_get_ns();
+
+		if (record) {
+			append_timing((char *)record + record->size);
+			record->size += TIMING_SECTION_SIZE;
+			record->flags |= SAMPLE_FLAG_TIMING;
+		} else {
+			append_timing((char *)cur_sample + sample_size - TIMING_SECTION_SIZE);
+		}
+	}
+
 	/* Figure out if we need to increase the buffer pointer */
-	if (flags & DUMPCACHE_CMD_AUTOINC_EN_SHIFT) {
+	if (record) {
+		if (flags & DUMPCACHE_CMD_AUTOINC_EN_SHIFT) {
+			cur_off += record->size;
+			cur_buf += 1;
+			ring_commit(record->size);
+		}
+	} else if (flags & DUMPCACHE_CMD_AUTOINC_EN_SHIFT) {
 		cur_buf += 1;
+		ring_commit(sample_size);
 
 		if (cur_buf >= CACHE_BUF_COUNT1 + CACHE_BUF_COUNT2) {
 			cur_buf = 0;
@@ -215,276 +1338,1980 @@ static int acquire_snapshot(void)
 	return 0;
 }
 
-static int dumpcache_config(unsigned long cmd)
+/* Release the counters of all the CPUs */
+static void pmu_stop(void)
 {
-	/* Set the sample buffer accoridng to what passed from user
-	 * space */
-	if(cmd & DUMPCACHE_CMD_SETBUF_SHIFT) {
-		uint32_t val = DUMPCACHE_CMD_VALUE(cmd);
+	int cpu, i;
 
-		if(val >= CACHE_BUF_COUNT1 + CACHE_BUF_COUNT2)
-			return -ENOMEM;
-		
-		cur_buf = val;
-		cur_sample = sample_from_index(val);	       
+	for (cpu = 0; cpu < MAX_STALL_CPUS; cpu++) {
+		for (i = 0; i < MAX_PMU_EVENTS; i++) {
+			if (pmu_counters[cpu][i])
+				perf_event_release_kernel(pmu_counters[cpu][i]);
+			pmu_counters[cpu][i] = NULL;
+		}
 	}
+}
 
-	if (cmd & DUMPCACHE_CMD_GETBUF_SHIFT) {
-		return cur_buf;
+/* Set up pinned counters for the selected events on every online
+ * CPU. Events a CPU does not implement are left out, and read as ~0.
+ * Fails only if no counter at all could be set up. */
+static int pmu_start(void)
+{
+	struct perf_event_attr attr;
+	struct perf_event * event;
+	int cpu, i, count = 0;
+
+	if (!perf_read_local_func)
+		return -ENOSYS;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_RAW;
+	attr.size = sizeof(attr);
+	attr.pinned = 1;
+
+	for_each_online_cpu(cpu) {
+		if (cpu >= MAX_STALL_CPUS)
+			break;
+
+		for (i = 0; i < MAX_PMU_EVENTS; i++) {
+			if (pmu_events[i] == PMU_EVENT_NONE)
+				continue;
+
+			attr.config = pmu_events[i];
+			event = perf_event_create_kernel_counter(&attr, cpu, NULL, NULL, NULL);
+			if (IS_ERR(event)) {
+				pr_warn("Unable to count event 0x%x on CPU %d: %ld\n",
+					pmu_events[i], cpu, PTR_ERR(event));
+				continue;
+			}
+
+			pmu_counters[cpu][i] = event;
+			++count;
+		}
 	}
 
-	if (cmd & DUMPCACHE_CMD_AUTOINC_EN_SHIFT) {
-		flags |= DUMPCACHE_CMD_AUTOINC_EN_SHIFT;
-	} else if (cmd & DUMPCACHE_CMD_AUTOINC_DIS_SHIFT) {
-		flags &= ~DUMPCACHE_CMD_AUTOINC_EN_SHIFT;
-	}
+	if (!count)
+		return -ENODEV;
 
-	if (cmd & DUMPCACHE_CMD_RESOLVE_EN_SHIFT) {
-		flags |= DUMPCACHE_CMD_RESOLVE_EN_SHIFT;		
-	} else if (cmd & DUMPCACHE_CMD_RESOLVE_DIS_SHIFT) {
-		flags &= ~DUMPCACHE_CMD_RESOLVE_EN_SHIFT;
-	}	
+	/* The section is self-describing */
+	for (i = 0; i < MAX_PMU_EVENTS; i++)
+		__scratch->pmu.events[i] = pmu_events[i];
 
 	return 0;
 }
 
-/* The IOCTL interface of the proc file descriptor is used to pass
- * configuration commands */
-static long dumpcache_ioctl(struct file *file, unsigned int ioctl, unsigned long arg)
+/* Full samples are followed by the sections that are enabled */
+static void update_sample_size(void)
 {
-	long err;
-	
-	switch (ioctl) {
-	case DUMPCACHE_CMD_CONFIG:
-		err = dumpcache_config(arg);
-		break;
+	size_t size = l2_sample_size + SECTIONS_MAX_SIZE;
 
-	case DUMPCACHE_CMD_SNAPSHOT:
-		err = acquire_snapshot();
-		break;
-		
-	default:
-		pr_err("Invalid command: 0x%08x\n", ioctl);
-		err = -EINVAL;
+	if (size == sample_size)
+		return;
+
+	/* Buffered full samples and the position of the next one
+	 * were laid out with the old size: start over */
+	sample_size = size;
+	cur_buf = 0;
+	cur_off = 0;
+	cur_sample = sample_from_index(0);
+	ring_reset(0);
+}
+
+/* Validate and apply a new set of events. Counters are set up again
+ * if they are in use. */
+static int dumpcache_pmu_events(struct pmu_events * e)
+{
+	uint32_t old_events[MAX_PMU_EVENTS];
+	int i, ret;
+
+	for (i = 0; i < MAX_PMU_EVENTS; i++) {
+		if (e->events[i] != PMU_EVENT_NONE && e->events[i] > 0xffff)
+			return -EINVAL;
+	}
+
+	memcpy(old_events, pmu_events, sizeof(pmu_events));
+	memcpy(pmu_events, e->events, sizeof(pmu_events));
+
+	if (!(flags & DUMPCACHE_CMD_PMU_EN_SHIFT))
+		return 0;
+
+	pmu_stop();
+	ret = pmu_start();
+	if (!ret)
+		return 0;
+
+	/* Keep counting the previous events, or stop counting if
+	 * they cannot be counted anymore either */
+	memcpy(pmu_events, old_events, sizeof(pmu_events));
+	if (pmu_start()) {
+		flags &= ~DUMPCACHE_CMD_PMU_EN_SHIFT;
+		update_sample_size();
+	}
+
+	return ret;
+}
+
+static int dumpcache_config(unsigned long cmd)
+{
+	unsigned long old_flags = flags;
+
+	/* The counters are the only thing that can fail: set them up
+	 * before any flag is committed */
+	if ((cmd & DUMPCACHE_CMD_PMU_EN_SHIFT) &&
+	    !(flags & DUMPCACHE_CMD_PMU_EN_SHIFT)) {
+		int ret = pmu_start();
+
+		if (ret)
+			return ret;
+	}
+
+	/* The sample format determines how buffer numbers are
+	 * interpreted, so handle it first */
+	if (cmd & DUMPCACHE_CMD_PACKED_EN_SHIFT) {
+		flags |= DUMPCACHE_CMD_PACKED_EN_SHIFT;
+	} else if (cmd & DUMPCACHE_CMD_PACKED_DIS_SHIFT) {
+		flags &= ~DUMPCACHE_CMD_PACKED_EN_SHIFT;
+	}
+
+	if (cmd & DUMPCACHE_CMD_DELTA_EN_SHIFT) {
+		flags |= DUMPCACHE_CMD_DELTA_EN_SHIFT;
+	} else if (cmd & DUMPCACHE_CMD_DELTA_DIS_SHIFT) {
+		flags &= ~DUMPCACHE_CMD_DELTA_EN_SHIFT;
+	}
+
+	if (cmd & DUMPCACHE_CMD_AGGREGATE_EN_SHIFT) {
+		flags |= DUMPCACHE_CMD_AGGREGATE_EN_SHIFT;
+	} else if (cmd & DUMPCACHE_CMD_AGGREGATE_DIS_SHIFT) {
+		flags &= ~DUMPCACHE_CMD_AGGREGATE_EN_SHIFT;
+	}
+
+	if (cmd & DUMPCACHE_CMD_AGG_CGROUPS_EN_SHIFT) {
+		flags |= DUMPCACHE_CMD_AGG_CGROUPS_EN_SHIFT;
+	} else if (cmd & DUMPCACHE_CMD_AGG_CGROUPS_DIS_SHIFT) {
+		flags &= ~DUMPCACHE_CMD_AGG_CGROUPS_EN_SHIFT;
+	}
+
+	if (cmd & DUMPCACHE_CMD_CLASSIFY_EN_SHIFT) {
+		flags |= DUMPCACHE_CMD_CLASSIFY_EN_SHIFT;
+	} else if (cmd & DUMPCACHE_CMD_CLASSIFY_DIS_SHIFT) {
+		flags &= ~DUMPCACHE_CMD_CLASSIFY_EN_SHIFT;
+	}
+
+	if (cmd & DUMPCACHE_CMD_PARALLEL_EN_SHIFT) {
+		flags |= DUMPCACHE_CMD_PARALLEL_EN_SHIFT;
+	} else if (cmd & DUMPCACHE_CMD_PARALLEL_DIS_SHIFT) {
+		flags &= ~DUMPCACHE_CMD_PARALLEL_EN_SHIFT;
+	}
+
+	if (cmd & DUMPCACHE_CMD_DEFER_EN_SHIFT) {
+		flags |= DUMPCACHE_CMD_DEFER_EN_SHIFT;
+	} else if (cmd & DUMPCACHE_CMD_DEFER_DIS_SHIFT) {
+		flags &= ~DUMPCACHE_CMD_DEFER_EN_SHIFT;
+	}
+
+	if (cmd & DUMPCACHE_CMD_RESOLVE_EN_SHIFT) {
+		flags |= DUMPCACHE_CMD_RESOLVE_EN_SHIFT;		
+	} else if (cmd & DUMPCACHE_CMD_RESOLVE_DIS_SHIFT) {
+		flags &= ~DUMPCACHE_CMD_RESOLVE_EN_SHIFT;
+	}	
+
+	/* The core and timing sections change the size of full
+	 * samples */
+	if (cmd & DUMPCACHE_CMD_CORES_EN_SHIFT) {
+		flags |= DUMPCACHE_CMD_CORES_EN_SHIFT;
+	} else if (cmd & DUMPCACHE_CMD_CORES_DIS_SHIFT) {
+		flags &= ~DUMPCACHE_CMD_CORES_EN_SHIFT;
+	}
+
+	if (cmd & DUMPCACHE_CMD_TIMESTAMP_EN_SHIFT) {
+		flags |= DUMPCACHE_CMD_TIMESTAMP_EN_SHIFT;
+	} else if (cmd & DUMPCACHE_CMD_TIMESTAMP_DIS_SHIFT) {
+		flags &= ~DUMPCACHE_CMD_TIMESTAMP_EN_SHIFT;
+	}
+
+	if (cmd & DUMPCACHE_CMD_PMU_EN_SHIFT) {
+		flags |= DUMPCACHE_CMD_PMU_EN_SHIFT;
+	} else if (cmd & DUMPCACHE_CMD_PMU_DIS_SHIFT) {
+		flags &= ~DUMPCACHE_CMD_PMU_EN_SHIFT;
+		pmu_stop();
+	}
+
+	update_sample_size();
+
+	/* If what lines are stored as changed, the next delta would
+	 * have no valid reference: start over with a keyframe */
+	if ((flags ^ old_flags) & DUMPCACHE_DELTA_FLAGS)
+		keyframe_countdown = 0;
+	
+	/* Set the sample buffer accoridng to what passed from user
+	 * space */
+	if(cmd & DUMPCACHE_CMD_SETBUF_SHIFT) {
+		uint32_t val = DUMPCACHE_CMD_VALUE(cmd);
+
+		if (flags & DUMPCACHE_RECORD_FORMATS) {
+			long off = offset_from_index(val);
+
+			if (off < 0)
+				return off;
+
+			cur_off = off;
+		} else if(val >= CACHE_BUF_COUNT1 + CACHE_BUF_COUNT2)
+			return -ENOMEM;
+		
+		cur_buf = val;
+		cur_sample = sample_from_index(val);	       
+
+		/* Start over with an empty ring */
+		if (flags & DUMPCACHE_RECORD_FORMATS)
+			ring_reset(cur_off);
+		else
+			ring_reset((unsigned long)val * sample_size);
+	}
+
+	if (cmd & DUMPCACHE_CMD_GETBUF_SHIFT) {
+		return cur_buf;
+	}
+
+	if (cmd & DUMPCACHE_CMD_AUTOINC_EN_SHIFT) {
+		flags |= DUMPCACHE_CMD_AUTOINC_EN_SHIFT;
+	} else if (cmd & DUMPCACHE_CMD_AUTOINC_DIS_SHIFT) {
+		flags &= ~DUMPCACHE_CMD_AUTOINC_EN_SHIFT;
+	}
+
+	return 0;
+}
+
+/* CPUs running, or about to run, a thread of the targets or of the
+ * cgroup of the filter, if any. Threads may well move around after
+ * this: snapshots taken with this policy are not guaranteed to be
+ * consistent. */
+static void target_cpus(struct cpumask * mask)
+{
+	struct task_struct * task, * t;
+	int i;
+
+	cpumask_clear(mask);
+
+	rcu_read_lock();
+	for (i = 0; i < target_count; i++) {
+		task = pid_task(targets[i], PIDTYPE_PID);
+		if (!task)
+			continue;
+
+		for_each_thread(task, t) {
+			if (t->state == TASK_RUNNING)
+				cpumask_set_cpu(task_cpu(t), mask);
+		}
+	}
+
+	/* Threads are matched by their cgroup v2, like pages by
+	 * their memory cgroup */
+	if (filter_cgroup) {
+		for_each_process_thread(task, t) {
+			if (t->state == TASK_RUNNING &&
+			    cgroup_is_descendant(task_dfl_cgroup(t), filter_cgroup))
+				cpumask_set_cpu(task_cpu(t), mask);
+		}
+	}
+	rcu_read_unlock();
+}
+
+/* Only keep the CPUs to be stalled according to the policy */
+static void restrict_stall(struct cpumask * mask)
+{
+	struct cpumask allowed;
+	int cpu;
+
+	switch (stall.policy) {
+	case STALL_POLICY_CPUMASK:
+		cpumask_clear(&allowed);
+		for (cpu = 0; cpu < min_t(int, nr_cpu_ids, 64); cpu++) {
+			if (stall.cpus & (1ULL << cpu))
+				cpumask_set_cpu(cpu, &allowed);
+		}
+		cpumask_and(mask, mask, &allowed);
+		break;
+
+	case STALL_POLICY_TARGETS:
+		target_cpus(&allowed);
+		cpumask_and(mask, mask, &allowed);
+		break;
+	}
+}
+
+/* Remember which CPUs are about to be stalled, for the headers */
+static void record_stalled(int self, const struct cpumask * stalled,
+			   const struct cpumask * workers)
+{
+	int cpu;
+
+	stalled_cpus = (self < 8) ? (1 << self) : 0;
+
+	for_each_cpu(cpu, stalled) {
+		if (cpu < 8)
+			stalled_cpus |= (1 << cpu);
+	}
+
+	if (!workers)
+		return;
+	
+	for_each_cpu(cpu, workers) {
+		if (cpu < 8)
+			stalled_cpus |= (1 << cpu);
+	}
+}
+
+/* Validate and apply a new stall policy */
+static int dumpcache_stall(struct stall_policy * p)
+{
+	if (p->policy > STALL_POLICY_TARGETS)
+		return -EINVAL;
+
+	stall = *p;
+	return 0;
+}
+
+/* Replace the processes under observation. Pids that no longer
+ * exist are skipped: they may exit while user space sets them. */
+static int dumpcache_targets(struct dump_targets * t)
+{
+	struct pid * pids[MAX_TARGETS];
+	int i, count = 0;
+
+	if (t->count > MAX_TARGETS)
+		return -EINVAL;
+
+	for (i = 0; i < t->count; i++) {
+		pids[count] = find_get_pid(t->pids[i]);
+		if (pids[count])
+			++count;
+	}
+
+	for (i = 0; i < target_count; i++)
+		put_pid(targets[i]);
+
+	memcpy(targets, pids, count * sizeof(pids[0]));
+	target_count = count;
+
+	/* Owners are resolved to global pids */
+	for (i = 0; i < target_count; i++)
+		target_nrs[i] = pid_nr(targets[i]);
+
+	/* A filtered delta would be encoded against other targets */
+	if (filter.mode == FILTER_TARGETS)
+		keyframe_countdown = 0;
+
+	return 0;
+}
+
+/* Validate and apply a new filter */
+static int dumpcache_filter(struct dump_filter * f)
+{
+	struct cgroup * cgrp = NULL;
+
+	if (f->mode > FILTER_CGROUP)
+		return -EINVAL;
+
+	if (f->mode == FILTER_CGROUP) {
+		/* Pages are matched through their memory cgroup */
+		if (!IS_ENABLED(CONFIG_MEMCG))
+			return -EOPNOTSUPP;
+		
+		f->cgroup[FILTER_PATH_MAX - 1] = '\0';
+		cgrp = cgroup_get_from_path(f->cgroup);
+		if (IS_ERR(cgrp))
+			return PTR_ERR(cgrp);
+	}
+
+	if (filter_cgroup)
+		cgroup_put(filter_cgroup);
+
+	/* Filtered lines are stored differently */
+	if (f->mode != filter.mode ||
+	    (f->mode == FILTER_CGROUP && strcmp(f->cgroup, filter.cgroup)))
+		keyframe_countdown = 0;
+
+	filter = *f;
+	filter_cgroup = cgrp;
+
+	return 0;
+}
+
+/* Validate and apply a new selection */
+static int dumpcache_select(struct dump_selection * s)
+{
+	if (s->last_set == 0)
+		s->last_set = geom.sets;
+	if (s->way_mask == 0)
+		s->way_mask = ALL_WAYS;
+
+	if (s->first_set >= s->last_set || s->last_set > geom.sets ||
+	    (s->way_mask & ~ALL_WAYS))
+		return -EINVAL;
+
+	/* Deltas cannot span different selections */
+	if (s->first_set != sel.first_set || s->last_set != sel.last_set ||
+	    s->way_mask != sel.way_mask)
+		keyframe_countdown = 0;
+
+	sel = *s;
+	
+	return 0;
+}
+
+/* Body of the periodic sampler. Snapshots are released on absolute
+ * deadlines, so the period does not drift with the time spent taking
+ * them. Periods missed because a snapshot took too long are
+ * skipped. */
+static int sampler_fn(void * data)
+{
+	struct sched_param param = { .sched_priority = MAX_RT_PRIO - 1 };
+	ktime_t next = ktime_get();
+	ktime_t now;
+	u64 missed = 0, late;
+
+	sched_setscheduler_nocheck(current, SCHED_FIFO, &param);
+	
+	while (!kthread_should_stop()) {
+		mutex_lock(&snapshot_mutex);
+		acquire_snapshot();
+		mutex_unlock(&snapshot_mutex);
+
+		next = ktime_add_ns(next, sampler_period_ns);
+		now = ktime_get();
+
+		if (ktime_before(next, now)) {
+			late = div64_u64(ktime_to_ns(ktime_sub(now, next)),
+					 sampler_period_ns) + 1;
+			next = ktime_add_ns(next, late * sampler_period_ns);
+			missed += late;
+		}
+		
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			break;
+		}
+		schedule_hrtimeout_range(&next, 0, HRTIMER_MODE_ABS);
+	}
+
+	if (missed)
+		pr_info("Periodic sampler missed %llu periods.\n", missed);
+	
+	return 0;
+}
+
+/* Start the periodic sampler on the calling CPU, or stop it if
+ * period_ns is 0 */
+static int sampler_config(unsigned long period_ns)
+{
+	struct task_struct * task;
+	
+	if (period_ns == 0) {
+		if (sampler_task) {
+			kthread_stop(sampler_task);
+			sampler_task = NULL;
+		}
+		return 0;
+	}
+
+	if (sampler_task)
+		return -EBUSY;
+
+	sampler_period_ns = period_ns;
+	task = kthread_create(sampler_fn, NULL, MODNAME "-sampler");
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	/* Snapshots must be taken from a CPU with access to the L2
+	 * RAMINDEX interface, like the one issuing the command */
+	kthread_bind(task, raw_smp_processor_id());
+
+	sampler_task = task;
+	wake_up_process(task);
+
+	return 0;
+}
+
+/* Body of the event-driven sampler. Overflows that happen while a
+ * snapshot is being taken are coalesced into the next one. */
+static int trigger_fn(void * data)
+{
+	struct sched_param param = { .sched_priority = MAX_RT_PRIO - 1 };
+	u64 coalesced = 0;
+	int pending;
+
+	sched_setscheduler_nocheck(current, SCHED_FIFO, &param);
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!atomic_read(&trigger_pending) && !kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+
+		pending = atomic_xchg(&trigger_pending, 0);
+		if (!pending)
+			continue;
+
+		coalesced += pending - 1;
+		
+		/* Whatever the snapshot itself causes is not counted,
+		 * and the next one is a whole period after it */
+		mutex_lock(&snapshot_mutex);
+		if (trigger_counter)
+			perf_event_disable(trigger_counter);
+
+		acquire_snapshot();
+
+		if (trigger_counter) {
+			local64_set(&trigger_counter->hw.period_left,
+				    trigger_counter->hw.sample_period);
+			perf_event_enable(trigger_counter);
+		}
+		mutex_unlock(&snapshot_mutex);
+	}
+
+	if (coalesced)
+		pr_info("Triggered sampler coalesced %llu overflows.\n", coalesced);
+	
+	return 0;
+}
+
+/* Runs in the PMU interrupt: leave the snapshot to the sampler
+ * thread, since IPIs cannot be sent from here */
+static void trigger_overflow(struct perf_event * event,
+			     struct perf_sample_data * data, struct pt_regs * regs)
+{
+	atomic_inc(&trigger_pending);
+	wake_up_process(trigger_task);
+}
+
+/* Release the counter first, so that no overflow is left to wake
+ * up the sampler once it is gone */
+static void trigger_stop(void)
+{
+	struct perf_event * event;
+
+	mutex_lock(&snapshot_mutex);
+	event = trigger_counter;
+	trigger_counter = NULL;
+	mutex_unlock(&snapshot_mutex);
+
+	if (event)
+		perf_event_release_kernel(event);
+	
+	if (trigger_task) {
+		kthread_stop(trigger_task);
+		trigger_task = NULL;
+	}
+}
+
+/* Start taking a snapshot on the calling CPU every time the counter
+ * of the trigger overflows, or stop if the period is 0 */
+static int trigger_config(struct pmu_trigger * t)
+{
+	struct perf_event_attr attr;
+	struct perf_event * event;
+	struct task_struct * task;
+	
+	if (t->period == 0) {
+		trigger_stop();
+		return 0;
+	}
+
+	if (trigger_task)
+		return -EBUSY;
+
+	if (t->cpu >= nr_cpu_ids || !cpu_online(t->cpu) || t->event > 0xffff)
+		return -EINVAL;
+
+	task = kthread_create(trigger_fn, NULL, MODNAME "-trigger");
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	/* Same constraint as the periodic sampler */
+	kthread_bind(task, raw_smp_processor_id());
+	atomic_set(&trigger_pending, 0);
+	trigger_task = task;
+	wake_up_process(task);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_RAW;
+	attr.size = sizeof(attr);
+	attr.config = t->event;
+	attr.sample_period = t->period;
+	attr.pinned = 1;
+	/* Snapshots run in the kernel and must not trigger more */
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	event = perf_event_create_kernel_counter(&attr, t->cpu, NULL, trigger_overflow, NULL);
+	if (IS_ERR(event)) {
+		kthread_stop(trigger_task);
+		trigger_task = NULL;
+		return PTR_ERR(event);
+	}
+
+	mutex_lock(&snapshot_mutex);
+	trigger_counter = event;
+	mutex_unlock(&snapshot_mutex);
+	return 0;
+}
+
+/* The IOCTL interface of the proc file descriptor is used to pass
+ * configuration commands */
+static long dumpcache_ioctl(struct file *file, unsigned int ioctl, unsigned long arg)
+{
+	long err;
+	
+	switch (ioctl) {
+	case DUMPCACHE_CMD_CONFIG:
+		mutex_lock(&snapshot_mutex);
+		err = dumpcache_config(arg);
+		mutex_unlock(&snapshot_mutex);
+		break;
+
+	case DUMPCACHE_CMD_SNAPSHOT:
+		mutex_lock(&snapshot_mutex);
+		err = acquire_snapshot();
+		mutex_unlock(&snapshot_mutex);
+		break;
+
+	case DUMPCACHE_CMD_KEYFRAME:
+		if (arg == 0) {
+			err = -EINVAL;
+			break;
+		}
+		mutex_lock(&snapshot_mutex);
+		keyframe_period = arg;
+		keyframe_countdown = 0;
+		mutex_unlock(&snapshot_mutex);
+		err = 0;
+		break;
+
+	case DUMPCACHE_CMD_PERIODIC:
+		mutex_lock(&sampler_mutex);
+		err = sampler_config(arg);
+		mutex_unlock(&sampler_mutex);
+		break;
+
+	case DUMPCACHE_CMD_SELECT:
+	{
+		struct dump_selection s;
+
+		if (copy_from_user(&s, (void __user *)arg, sizeof(s))) {
+			err = -EFAULT;
+			break;
+		}
+		mutex_lock(&snapshot_mutex);
+		err = dumpcache_select(&s);
+		mutex_unlock(&snapshot_mutex);
+		break;
+	}
+
+	case DUMPCACHE_CMD_TRIGGER:
+	{
+		struct pmu_trigger t;
+
+		if (copy_from_user(&t, (void __user *)arg, sizeof(t))) {
+			err = -EFAULT;
+			break;
+		}
+		mutex_lock(&sampler_mutex);
+		err = trigger_config(&t);
+		mutex_unlock(&sampler_mutex);
+		break;
+	}
+
+	case DUMPCACHE_CMD_STALL:
+	{
+		struct stall_policy p;
+
+		if (copy_from_user(&p, (void __user *)arg, sizeof(p))) {
+			err = -EFAULT;
+			break;
+		}
+		mutex_lock(&snapshot_mutex);
+		err = dumpcache_stall(&p);
+		mutex_unlock(&snapshot_mutex);
+		break;
+	}
+
+	case DUMPCACHE_CMD_TARGETS:
+	{
+		struct dump_targets * t = kmalloc(sizeof(*t), GFP_KERNEL);
+
+		if (!t) {
+			err = -ENOMEM;
+			break;
+		}
+		if (copy_from_user(t, (void __user *)arg, sizeof(*t))) {
+			kfree(t);
+			err = -EFAULT;
+			break;
+		}
+		mutex_lock(&snapshot_mutex);
+		err = dumpcache_targets(t);
+		mutex_unlock(&snapshot_mutex);
+		kfree(t);
+		break;
+	}
+
+	case DUMPCACHE_CMD_FILTER:
+	{
+		struct dump_filter * f = kmalloc(sizeof(*f), GFP_KERNEL);
+
+		if (!f) {
+			err = -ENOMEM;
+			break;
+		}
+		if (copy_from_user(f, (void __user *)arg, sizeof(*f))) {
+			kfree(f);
+			err = -EFAULT;
+			break;
+		}
+		mutex_lock(&snapshot_mutex);
+		err = dumpcache_filter(f);
+		mutex_unlock(&snapshot_mutex);
+		kfree(f);
 		break;
 	}
-	
-	return err;
+
+	case DUMPCACHE_CMD_PMU_EVENTS:
+	{
+		struct pmu_events e;
+
+		if (copy_from_user(&e, (void __user *)arg, sizeof(e))) {
+			err = -EFAULT;
+			break;
+		}
+		mutex_lock(&snapshot_mutex);
+		err = dumpcache_pmu_events(&e);
+		mutex_unlock(&snapshot_mutex);
+		break;
+	}
+
+	case DUMPCACHE_CMD_GEOMETRY:
+		if (copy_to_user((void __user *)arg, &geom, sizeof(geom)))
+			err = -EFAULT;
+		else
+			err = 0;
+		break;
+
+	case DUMPCACHE_CMD_RING_STATUS:
+	{
+		struct ring_status status;
+
+		ring_get_status(&status);
+		if (copy_to_user((void __user *)arg, &status, sizeof(status)))
+			err = -EFAULT;
+		else
+			err = 0;
+		break;
+	}
+
+	case DUMPCACHE_CMD_RING_CONSUME:
+		err = ring_consume(arg);
+		break;
+		
+	default:
+		pr_err("Invalid command: 0x%08x\n", ioctl);
+		err = -EINVAL;
+		break;
+	}
+	
+	return err;
+}
+
+
+/* The proc file is readable whenever the ring holds unconsumed
+ * samples */
+static unsigned int dumpcache_poll(struct file *file, poll_table *wait)
+{
+	unsigned int mask = 0;
+
+	poll_wait(file, &ring_wait, wait);
+
+	if (READ_ONCE(ring.pending))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
+static const struct seq_operations dumpcache_seq_ops = {
+	.start	= c_start,
+	.next	= c_next,
+	.stop	= c_stop,
+	.show	= c_show
+};
+	
+/* ProcFS entry setup and definitions  */
+static const struct file_operations dumpcache_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = dumpcache_ioctl,
+	.compat_ioctl = dumpcache_ioctl,
+	.open    = dumpcache_open,
+	.mmap    = dumpcache_mmap,
+	.poll    = dumpcache_poll,
+	.read    = seq_read,
+	.llseek	 = seq_lseek,
+	.release = seq_release
+};
+
+static inline void asm_flush_cache(void) {
+    asm volatile(
+        "MCR p15, 0, r0, c7, c5, 0\t\n"
+        "MCR p15, 0, Rd, c7, c6, 0"
+    );
+}
+
+// Ramindex operation
+// 4.3.64 in ARM Cortex-A57 MPCore Processor Technical Reference Manual
+static inline void asm_ramindex_mcr(u32 ramindex)
+{
+	asm volatile(
+	    "sys #0, c15, c4, #0, %0\t\n"
+	    "dsb sy\t\n"
+	    "isb" :: "r" (ramindex));
+}
+
+
+// reading from DL1DATA0_EL1
+// 4.3.63 in ARM Cortex-A57 MPCore Processor Technical Reference Manual
+static inline void asm_ramindex_mrc(u32 *dl1data, u8 sel)
+{
+	if (sel & 0x01) asm volatile("mrs %0,S3_0_c15_c1_0" : "=r"(dl1data[0]));
+	if (sel & 0x02) asm volatile("mrs %0,S3_0_c15_c1_1" : "=r"(dl1data[1]));
+	if (sel & 0x04) asm volatile("mrs %0,S3_0_c15_c1_2" : "=r"(dl1data[2]));
+	if (sel & 0x08) asm volatile("mrs %0,S3_0_c15_c1_3" : "=r"(dl1data[3]));
+}
+
+
+/* Read the geometry of the L2 from CLIDR_EL1 and CCSIDR_EL1 of the
+ * calling CPU. Must be called with preemption disabled. */
+static int probe_geometry(struct cache_geometry * g)
+{
+	u64 clidr, ccsidr;
+
+	asm volatile("mrs %0, clidr_el1" : "=r"(clidr));
+
+	/* Ctype2 must report a unified cache */
+	if (((clidr >> 3) & 0x7) != 0x4)
+		return -ENODEV;
+
+	/* Select level 2, data or unified */
+	asm volatile(
+	    "msr csselr_el1, %0\t\n"
+	    "isb" :: "r" (2UL));
+	asm volatile("mrs %0, ccsidr_el1" : "=r"(ccsidr));
+	
+	g->line_size = 1 << ((ccsidr & 0x7) + 4);
+	g->ways = ((ccsidr >> 3) & 0x3ff) + 1;
+	g->sets = ((ccsidr >> 13) & 0x7fff) + 1;
+	g->size = g->sets * g->ways * g->line_size;
+
+	return 0;
+}
+
+// Get Tag of L2 cache entry at (index,way), and its MOESI state bits
+// Tag bank select ignored, 64-byte lines and TAG_SETS sets assumed
+static inline void get_tag(u32 index, u32 way, u32 *dl1data, u32 *state)
+{
+	u32 ramindex = RAMINDEX(RAMID_L2_TAG, way, index << 6);
+	asm_ramindex_mcr(ramindex);
+	asm_ramindex_mrc(dl1data, 0x01);
+
+	*state = (*dl1data) & 0x03UL;
+	
+	// Check if MOESI state is invalid, and if so, zero out the address
+	if (*state == 0) {
+		*dl1data = 0;
+		return;
+	}
+	// Isolate the tag
+	*dl1data &= ~(0x03UL);
+	*dl1data <<= 12;
+	*dl1data |= (index << 5);
+}
+
+bool rmap_one_func(struct page *page, struct vm_area_struct *vma, unsigned long addr, void *arg)
+{
+        
+	struct mm_struct* mm;
+	struct task_struct* ts;
+	struct process_data
+	{
+		pid_t pid;
+		uint64_t addr;
+	};
+
+	((struct process_data*) arg)->addr = 0;
+
+	// Check if mm struct is null
+	mm = vma->vm_mm;
+	if (!mm) {
+		((struct process_data*) arg)->pid = RMAP_FAILED_PID;
+		return true;
+	}
+
+	// Check if task struct is null. The owner can exit and be
+	// freed unless all CPUs are stalled.
+	rcu_read_lock();
+	ts = rcu_dereference(mm->owner);
+	if (!ts) {
+		rcu_read_unlock();
+		((struct process_data*) arg)->pid = RMAP_FAILED_PID;
+		return true;
+	}
+
+	// If pid is 1, continue searching pages
+	if ((ts->pid) == 1) {
+		((struct process_data*) arg)->pid = (ts->pid);
+		rcu_read_unlock();
+		return true;
+	}
+
+	// *Probably* the correct pid
+	((struct process_data*) arg)->pid = (ts->pid);
+	((struct process_data*) arg)->addr = addr;
+	rcu_read_unlock();
+	return false;
+}
+
+int done_func(struct page *page)
+{
+	return 1;
+} 
+
+
+bool invalid_func(struct vm_area_struct *vma, void *arg)
+{
+	struct process_data
+	{
+		pid_t pid;
+		uint64_t addr;
+	};
+
+	((struct process_data*) arg)->pid = RMAP_FAILED_PID;
+	return false;
+} 
+
+/* The only VMA in an interval tree, or NULL if there are more */
+static inline struct rb_node * single_node(struct rb_root * root)
+{
+	struct rb_node * node = READ_ONCE(root->rb_node);
+
+	if (!node || node->rb_left || node->rb_right)
+		return NULL;
+
+	return node;
+}
+
+/* Cheap resolution of pages mapped exactly once, when their anon_vma
+ * or file is only mapped by one VMA: that VMA is the owner, and the
+ * address follows from the page offset. THP tail pages are looked up
+ * through their head. Returns false if a full walk is needed.
+ *
+ * The interval trees are read without their locks: only use this
+ * while every other CPU is stalled. */
+static bool resolve_page_fast(struct page * page, struct cache_line * owner)
+{
+	struct page * head = compound_head(page);
+	unsigned long mapping = (unsigned long)READ_ONCE(head->mapping);
+	struct vm_area_struct * vma;
+	struct rb_node * node;
+	pgoff_t pgoff;
+
+	if (page_mapcount(page) != 1)
+		return false;
+
+	/* KSM and movable pages are left to the walk */
+	if ((mapping & PAGE_MAPPING_FLAGS) == PAGE_MAPPING_ANON) {
+		struct anon_vma * anon_vma = (struct anon_vma *)(mapping - PAGE_MAPPING_ANON);
+
+		if (!(node = single_node(&anon_vma->rb_root)))
+			return false;
+		vma = rb_entry(node, struct anon_vma_chain, rb)->vma;
+	} else if (mapping && !(mapping & PAGE_MAPPING_FLAGS)) {
+		struct address_space * file = (struct address_space *)mapping;
+
+		if (!(node = single_node(&file->i_mmap)))
+			return false;
+		vma = rb_entry(node, struct vm_area_struct, shared.rb);
+	} else {
+		return false;
+	}
+
+	pgoff = page_to_pgoff(page);
+	if (pgoff < vma->vm_pgoff || pgoff >= vma->vm_pgoff + vma_pages(vma))
+		return false;
+
+	rmap_one_func(page, vma, vma->vm_start + ((pgoff - vma->vm_pgoff) << PAGE_SHIFT), owner);
+	return true;
+}
+
+/* Find the pid of the owner of a page and the virtual address it is
+ * mapped at (0 if none was found). The reverse map is only walked if
+ * the fast path does not apply. Unless every other CPU is stalled,
+ * the page is pinned and locked, and the walk takes the rmap locks:
+ * this may sleep. */
+static void resolve_page(struct page * page, struct cache_line * owner, bool stalled)
+{
+	struct rmap_walk_control rwc;
+	struct rmap_walk_control * rwc_p;
+
+	// Instantiate rmap walk control struct
+	rwc.arg = owner;
+	rwc.rmap_one = rmap_one_func;
+	rwc.done = NULL; //done_func;
+	rwc.anon_lock = NULL;
+	rwc.invalid_vma = invalid_func;
+	rwc_p = &rwc;
+
+	/* Reset owner */
+	owner->pid = 0;
+	owner->addr = 0;
+
+	if (stalled && resolve_page_fast(page, owner))
+		return;
+
+	if (stalled) {
+		// This call populates the struct in rwc struct
+		rmap_walk_func(page, rwc_p);
+		return;
+	}
+
+	/* Freed pages have no owner */
+	if (!get_page_unless_zero(page))
+		return;
+
+	/* Keeps page->mapping and the anon_vma stable during the
+	 * walk. Pages locked by someone else are given up on. */
+	if (!trylock_page(page)) {
+		owner->pid = RMAP_FAILED_PID;
+	} else {
+		if (page_mapped(page))
+			rmap_walk_locking_func(page, rwc_p);
+		unlock_page(page);
+	}
+
+	put_page(page);
+}
+
+/* Rule out the pages the filter would reject whatever their owner:
+ * those no process maps and, with a cgroup filter, those charged to
+ * another memory cgroup. Neither needs an rmap walk. */
+static inline bool page_may_match(struct page * page)
+{
+	if (filter.mode == FILTER_NONE)
+		return true;
+
+	if (!page_mapped(page))
+		return false;
+
+#ifdef CONFIG_MEMCG
+	if (filter.mode == FILTER_CGROUP) {
+		struct mem_cgroup * memcg = READ_ONCE(page->mem_cgroup);
+
+		return memcg && cgroup_is_descendant(memcg->css.cgroup, filter_cgroup);
+	}
+#endif
+
+	return true;
+}
+
+/* Whether the owner of a page is one of the targets */
+static inline bool owner_matches(pid_t pid)
+{
+	int i;
+
+	if (filter.mode != FILTER_TARGETS)
+		return true;
+
+	for (i = 0; i < target_count; i++) {
+		if (target_nrs[i] == pid)
+			return true;
+	}
+
+	return false;
+}
+
+/* Not defined by older kernels, where __pa() handles symbols too */
+#ifndef __pa_symbol
+#define __pa_symbol(x) __pa(x)
+#endif
+
+/* Kind of a page that no process maps. Page tables can only be told
+ * apart on kernels that flag them. */
+static pid_t classify_page(struct page * page, u64 paddr)
+{
+	struct page * head = compound_head(page);
+	unsigned long mapping;
+
+	if (paddr >= __pa_symbol(_text) && paddr < __pa_symbol(_end))
+		return PAGE_CLASS_PID(PAGE_CLASS_KERNEL);
+
+	if (PageBuddy(page) || !page_count(head))
+		return PAGE_CLASS_PID(PAGE_CLASS_FREE);
+
+	if (PageSlab(head))
+		return PAGE_CLASS_PID(PAGE_CLASS_SLAB);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+	if (PageTable(page))
+		return PAGE_CLASS_PID(PAGE_CLASS_PGTABLE);
+#endif
+
+	mapping = (unsigned long)READ_ONCE(head->mapping);
+	if (mapping && !(mapping & PAGE_MAPPING_FLAGS))
+		return PAGE_CLASS_PID(PAGE_CLASS_PAGECACHE);
+
+	return PAGE_CLASS_PID(PAGE_CLASS_OTHER);
+}
+
+/* Find the memo slot for a page in the table of the chunk the set
+ * belongs to. Either the slot already holds the page, or it is the
+ * free slot where the page should be recorded. */
+static inline struct pfn_memo * memo_lookup(u32 index, unsigned long pfn)
+{
+	struct pfn_memo * table = __scratch->memo[index / DUMP_CHUNK_SETS];
+	uint64_t key = MEMO_KEY(memo_gen, pfn);
+	u32 slot;
+
+	/* The low bits of the pfn select the chunk: leave them out */
+	slot = hash_long(pfn / DUMP_CHUNKS, MEMO_BITS);
+
+	/* Entries left by older snapshots count as free */
+	while (table[slot].key != key && MEMO_KEY_GEN(table[slot].key) == memo_gen)
+		slot = (slot + 1) & (MEMO_SLOTS - 1);
+
+	return &table[slot];
+}
+
+/* Resolve the physical address of a valid line to the pid and
+ * virtual address of its owner. Each page is only walked once per
+ * snapshot: other lines of the same page reuse the result. */
+static void resolve_line(u32 index, u32 physical_address, struct cache_line * line,
+			 bool stalled)
+{
+	u64 paddr = ((u64)physical_address << 1);
+	unsigned long pfn = PHYS_PFN(paddr);
+	struct pfn_memo * memo = memo_lookup(index, pfn);
+	
+	/* This will be used to invoke address resolution */
+	struct cache_line process_data_struct;
+	uint64_t vaddr;
+
+	if (memo->key != MEMO_KEY(memo_gen, pfn)) {
+		struct page * page = pfn_to_page(pfn);
+
+		if (!page_may_match(page)) {
+			process_data_struct.pid = FILTERED_PID;
+			process_data_struct.addr = 0;
+		} else {
+			resolve_page(page, &process_data_struct, stalled);
+
+			if (!owner_matches(process_data_struct.pid)) {
+				process_data_struct.pid = FILTERED_PID;
+				process_data_struct.addr = 0;
+			} else if ((flags & DUMPCACHE_CMD_CLASSIFY_EN_SHIFT) &&
+				   (!process_data_struct.pid ||
+				    (process_data_struct.pid == RMAP_FAILED_PID &&
+				     !page_mapped(page)))) {
+				/* Failed walks of pages that are no longer
+				 * mapped are classified too. Pages still
+				 * mapped belong to a process that could not
+				 * be found: they stay RMAP_FAILED_PID. */
+				process_data_struct.pid = classify_page(page, paddr);
+			}
+		}
+		
+		memo->owner = MEMO_OWNER(process_data_struct.pid, process_data_struct.addr);
+		memo->key = MEMO_KEY(memo_gen, pfn);
+	}
+
+	// Fill cacheline struct with values obtained from rmap_walk_func
+	line->pid = MEMO_OWNER_PID(memo->owner);
+	line->addr = paddr;
+
+	if (line->pid == RMAP_FAILED_PID)
+		atomic_inc(&rmap_failures);
+
+	vaddr = MEMO_OWNER_ADDR(memo->owner);
+	if(vaddr != 0) {
+#if FULL_ADDRESS == 0
+		line->addr = vaddr;
+#else
+		line->addr = vaddr | (paddr & 0xfff);
+#endif			
+	}
+}
+
+/* Samples in the full format are reused: an invalid way must not
+ * show what the same buffer held in an earlier snapshot */
+static inline void clear_line(struct cache_line * line)
+{
+	line->pid = 0;
+	line->state = 0;
+	line->addr = 0;
+}
+
+static int __dump_index_resolve(int index, struct cache_line* buf)
+{
+	int way, valid = 0;
+	u32 physical_address, state;
+
+	for (way = 0; way < geom.ways; way++) {
+		if (!SEL_HAS_WAY(way))
+			continue;
+		
+		get_tag(index, way, &physical_address, &state);
+		if (!physical_address) {
+			clear_line(&buf[way]);
+			continue;
+		}
+
+		resolve_line(index, physical_address, &buf[way], true);
+		buf[way].state = state;
+		++valid;
+	}
+       
+	return valid;
+}
+
+static inline int __dump_line_noresolve(u32 index, u32 way, struct cache_line* buf)
+{
+	u32 physical_address, state;
+
+	get_tag(index, way, &physical_address, &state);
+	if (!physical_address) {
+		clear_line(&buf[way]);
+		return 0;
+	}
+		
+	// Initalize struct
+	buf[way].pid = 0; //process_data_struct->pid;// = 0;
+	buf[way].state = state;
+	buf[way].addr = ((u64)physical_address); //process_data_struct->addr;// = 0;
+	return 1;
+}
+
+/* Returns the number of valid lines found */
+static int dump_all_indices(void) {
+	return dump_sets(sel.first_set, sel.last_set);
+}
+
+/* Read the tag at (index, way) and return the line in packed form,
+ * or 0 if the way is invalid. Unlike the full format, addresses of
+ * unresolved lines are always physical. */
+static inline uint64_t get_packed_line(u32 index, u32 way)
+{
+	u32 physical_address, state;
+	struct cache_line line;
+
+	get_tag(index, way, &physical_address, &state);
+	if (!physical_address)
+		return 0;
+
+	if ((flags & DUMPCACHE_CMD_RESOLVE_EN_SHIFT) && !DUMPCACHE_RESOLVE_DEFERRED(flags)) {
+		resolve_line(index, physical_address, &line, true);
+	} else {
+		line.pid = 0;
+		line.addr = ((u64)physical_address << 1);
+	}
+
+	return PACKED_LINE(line.pid, line.addr) | PACKED_STATE(state);
+}
+
+/* Second phase of a deferred snapshot: resolve the raw lines left in
+ * the scratch area once the other CPUs are running again. They can
+ * change the mappings meanwhile, so pages are resolved with the
+ * locking walk. */
+static void resolve_capture(void)
+{
+	int i, way;
+	uint64_t line;
+	struct cache_line resolved;
+
+	for (i = sel.first_set; i < sel.last_set; i++) {
+		for (way = 0; way < geom.ways; way++) {
+			line = __scratch->capture[i * geom.ways + way];
+			if (!line || !SEL_HAS_WAY(way))
+				continue;
+
+			resolve_line(i, PACKED_LINE_ADDR(line) >> 1, &resolved, false);
+			__scratch->capture[i * geom.ways + way] =
+				PACKED_LINE(resolved.pid, resolved.addr) | (line & PACKED_STATE_MASK);
+		}
+	}
+}
+
+/* Fill a sample in the full format with the resolved lines. As for
+ * a direct dump, invalid ways are cleared. */
+static void expand_capture(struct cache_line * sample)
+{
+	int i, way;
+	uint64_t line;
+
+	for (i = sel.first_set * geom.ways; i < sel.last_set * geom.ways; i += geom.ways) {
+		for (way = 0; way < geom.ways; way++) {
+			line = __scratch->capture[i + way];
+			if (!SEL_HAS_WAY(way))
+				continue;
+
+			if (!line) {
+				clear_line(&sample[i + way]);
+				continue;
+			}
+
+			sample[i + way].pid = PACKED_LINE_PID(line);
+			sample[i + way].state = PACKED_LINE_STATE(line);
+			sample[i + way].addr = PACKED_LINE_ADDR(line);
+		}
+	}
+}
+
+/* Save the L1 tags and TLB entries of the calling core in the next
+ * free slot of the core section */
+static void capture_core(struct dump_job * job)
+{
+	struct core_sample * core;
+	u32 data[4];
+	int slot, set, way, i;
+
+	slot = atomic_inc_return(&job->next_core) - 1;
+	if (slot >= MAX_CLUSTER_CPUS)
+		goto out;
+
+	core = &__scratch->cores[slot];
+	core->cpu = smp_processor_id();
+
+	for (set = 0; set < L1D_SETS; set++) {
+		for (way = 0; way < L1D_WAYS; way++) {
+			asm_ramindex_mcr(RAMINDEX(RAMID_L1D_TAG, way, set << 6));
+			asm_ramindex_mrc(data, 0x03);
+			core->l1d_tags[set * L1D_WAYS + way] = ((u64)data[1] << 32) | data[0];
+		}
+	}
+
+	for (set = 0; set < L1I_SETS; set++) {
+		for (way = 0; way < L1I_WAYS; way++) {
+			asm_ramindex_mcr(RAMINDEX(RAMID_L1I_TAG, way, set << 6));
+			asm_ramindex_mrc(data, 0x03);
+			core->l1i_tags[set * L1I_WAYS + way] = ((u64)data[1] << 32) | data[0];
+		}
+	}
+
+	for (i = 0; i < L1D_TLB_ENTRIES; i++) {
+		asm_ramindex_mcr(RAMINDEX(RAMID_L1D_TLB, 0, i));
+		asm_ramindex_mrc(data, 0x0f);
+		core->l1d_tlb[2 * i] = ((u64)data[1] << 32) | data[0];
+		core->l1d_tlb[2 * i + 1] = ((u64)data[3] << 32) | data[2];
+	}
+
+	for (set = 0; set < L2_TLB_SETS; set++) {
+		for (way = 0; way < L2_TLB_WAYS; way++) {
+			i = set * L2_TLB_WAYS + way;
+			asm_ramindex_mcr(RAMINDEX(RAMID_L2_TLB, way, set));
+			asm_ramindex_mrc(data, 0x0f);
+			core->l2_tlb[2 * i] = ((u64)data[1] << 32) | data[0];
+			core->l2_tlb[2 * i + 1] = ((u64)data[3] << 32) | data[2];
+		}
+	}
+
+out:
+	wmb();
+	atomic_dec(&job->cores_pending);
+}
+
+/* Copy the core section out of the scratch area. Both sides are
+ * uncached, so stick to aligned 64-bit accesses. */
+static void append_cores(void * dst)
+{
+	const uint64_t * from = (const uint64_t *)__scratch->cores;
+	uint64_t * to = dst;
+	size_t i;
+
+	for (i = 0; i < CORE_SECTION_SIZE / sizeof(uint64_t); i++)
+		to[i] = from[i];
+}
+
+/* Read the counters of the calling CPU. Runs with interrupts
+ * disabled, on the CPU the counters belong to. */
+static void read_pmu(int cpu)
+{
+	struct perf_event * event;
+	int i;
+
+	if (cpu >= MAX_STALL_CPUS)
+		return;
+
+	for (i = 0; i < MAX_PMU_EVENTS; i++) {
+		event = pmu_counters[cpu][i];
+		if (event)
+			__scratch->pmu.counts[cpu][i] = perf_read_local_func(event);
+	}
 }
 
+/* Same as append_cores for the PMU section */
+static void append_pmu(void * dst)
+{
+	const uint64_t * from = (const uint64_t *)&__scratch->pmu;
+	uint64_t * to = dst;
+	size_t i;
 
-static const struct seq_operations dumpcache_seq_ops = {
-	.start	= c_start,
-	.next	= c_next,
-	.stop	= c_stop,
-	.show	= c_show
-};
+	BUILD_BUG_ON(PMU_SECTION_SIZE % sizeof(uint64_t));
+	for (i = 0; i < PMU_SECTION_SIZE / sizeof(uint64_t); i++)
+		to[i] = from[i];
+}
+
+/* Same for the timing section */
+static void append_timing(void * dst)
+{
+	const uint64_t * from = (const uint64_t *)&__scratch->timing;
+	uint64_t * to = dst;
+	size_t i;
+
+	BUILD_BUG_ON(TIMING_SECTION_SIZE % sizeof(uint64_t));
+	for (i = 0; i < TIMING_SECTION_SIZE / sizeof(uint64_t); i++)
+		to[i] = from[i];
+}
+
+/* Unroll the RAMINDEX sequence of a whole set */
+#define UNROLL_2(f, set, way)  f(set, way); f(set, (way) + 1)
+#define UNROLL_4(f, set, way)  UNROLL_2(f, set, way); UNROLL_2(f, set, (way) + 2)
+#define UNROLL_8(f, set, way)  UNROLL_4(f, set, way); UNROLL_4(f, set, (way) + 4)
+#define UNROLL_16(f, set, way) UNROLL_8(f, set, way); UNROLL_8(f, set, (way) + 8)
+
+#define CAPTURE_LINE(set, way)						\
+	valid += !!(capture[(set) * stride + (way)] = get_packed_line(set, way))
+#define DUMP_LINE_NORESOLVE(set, way)					\
+	valid += __dump_line_noresolve(set, way, &cur_sample[(set) * stride])
+
+/* Capture the content of sets [first, last) in packed form into the
+ * scratch area. Records are encoded out of it once the other CPUs
+ * have been released. The direct dump of unresolved lines in the
+ * full format gets the same treatment. */
+#define DEFINE_DUMP_LOOPS(nways)					\
+static int capture_sets_##nways(int first, int last)			\
+{									\
+	const u32 stride = nways;					\
+	uint64_t * capture = __scratch->capture;			\
+	int i, valid = 0;						\
+									\
+	for (i = first; i < last; i++) {				\
+		UNROLL_##nways(CAPTURE_LINE, i, 0);			\
+	}								\
+	return valid;							\
+}									\
+									\
+static int dump_sets_noresolve_##nways(int first, int last)		\
+{									\
+	const u32 stride = nways;					\
+	int i, valid = 0;						\
+									\
+	for (i = first; i < last; i++) {				\
+		UNROLL_##nways(DUMP_LINE_NORESOLVE, i, 0);		\
+	}								\
+	return valid;							\
+}									\
+									\
+static const struct dump_loops dump_loops_##nways = {			\
+	.capture = capture_sets_##nways,				\
+	.noresolve = dump_sets_noresolve_##nways,			\
+}
+
+DEFINE_DUMP_LOOPS(16);
+DEFINE_DUMP_LOOPS(8);
+
+/* Fallback for any other number of ways, or for a subset of them */
+static int capture_sets_generic(int first, int last)
+{
+	const u32 stride = geom.ways;
+	uint64_t * capture = __scratch->capture;
+	int i, way, valid = 0;
 	
-/* ProcFS entry setup and definitions  */
-static const struct file_operations dumpcache_fops = {
-	.owner = THIS_MODULE,
-	.unlocked_ioctl = dumpcache_ioctl,
-	.compat_ioctl = dumpcache_ioctl,
-	.open    = dumpcache_open,
-	.read    = seq_read,
-	.llseek	 = seq_lseek,
-	.release = seq_release
-};
+	for (i = first; i < last; i++) {
+		for (way = 0; way < stride; way++) {
+			if (SEL_HAS_WAY(way))
+				CAPTURE_LINE(i, way);
+		}
+	}
 
-static inline void asm_flush_cache(void) {
-    asm volatile(
-        "MCR p15, 0, r0, c7, c5, 0\t\n"
-        "MCR p15, 0, Rd, c7, c6, 0"
-    );
+	return valid;
 }
 
-// Ramindex operation
-// 4.3.64 in ARM Cortex-A57 MPCore Processor Technical Reference Manual
-static inline void asm_ramindex_mcr(u32 ramindex)
+static int dump_sets_noresolve_generic(int first, int last)
 {
-	asm volatile(
-	    "sys #0, c15, c4, #0, %0\t\n"
-	    "dsb sy\t\n"
-	    "isb" :: "r" (ramindex));
+	const u32 stride = geom.ways;
+	int i, way, valid = 0;
+	
+	for (i = first; i < last; i++) {
+		for (way = 0; way < stride; way++) {
+			if (SEL_HAS_WAY(way))
+				DUMP_LINE_NORESOLVE(i, way);
+		}
+	}
+
+	return valid;
 }
 
+static const struct dump_loops dump_loops_generic = {
+	.capture = capture_sets_generic,
+	.noresolve = dump_sets_noresolve_generic,
+};
 
-// reading from DL1DATA0_EL1
-// 4.3.63 in ARM Cortex-A57 MPCore Processor Technical Reference Manual
-static inline void asm_ramindex_mrc(u32 *dl1data, u8 sel)
+/* Dump sets [first, last) into the current sample or, for
+ * variable-size records and deferred resolution, into the scratch
+ * area. Returns the number of valid lines found. */
+static int dump_sets(int first, int last)
 {
-	if (sel & 0x01) asm volatile("mrs %0,S3_0_c15_c1_0" : "=r"(dl1data[0]));
-	if (sel & 0x02) asm volatile("mrs %0,S3_0_c15_c1_1" : "=r"(dl1data[1]));
-	if (sel & 0x04) asm volatile("mrs %0,S3_0_c15_c1_2" : "=r"(dl1data[2]));
-	if (sel & 0x08) asm volatile("mrs %0,S3_0_c15_c1_3" : "=r"(dl1data[3]));
+	const struct dump_loops * l = loops;
+	int i, valid = 0;
+
+	/* Unrolled loops only work on whole sets */
+	if (sel.way_mask != ALL_WAYS)
+		l = &dump_loops_generic;
+	
+	if ((flags & DUMPCACHE_RECORD_FORMATS) || DUMPCACHE_RESOLVE_DEFERRED(flags))
+		return l->capture(first, last);
+
+	/* Invoke a smaller-footprint loop in case address resolution
+	 * has not been requested */
+	if (!(flags & DUMPCACHE_CMD_RESOLVE_EN_SHIFT))
+		return l->noresolve(first, last);
+	
+	for (i = first; i < last; i++)
+		valid += __dump_index_resolve(i, &cur_sample[i * geom.ways]);
+
+	return valid;
 }
 
+/* Claim chunks of sets and dump them until none is left. Runs on
+ * every CPU taking part in a parallel dump. */
+static void dump_chunks(struct dump_job * job)
+{
+	int chunk, first, last, valid;
+
+	while ((chunk = atomic_inc_return(&job->next) - 1) < job->chunks) {
+		first = job->base + chunk * DUMP_CHUNK_SETS;
+		last = first + DUMP_CHUNK_SETS;
+		
+		valid = dump_sets(max_t(int, first, sel.first_set), min_t(int, last, sel.last_set));
+		atomic_add(valid, &job->valid);
+
+		/* Make the dumped sets visible before reporting */
+		wmb();
+		atomic_dec(&job->pending);
+	}
+}
 
-// Get Tag of L2 cache entry at (index,way)
-// Tag bank select ignored, 2MB L2 cache assumed
-static inline void get_tag(u32 index, u32 way, u32 *dl1data)
+/* Count the filtered lines of each selected set after the lines of
+ * a record. Returns the size of the section. */
+static uint32_t encode_other(uint8_t * other)
 {
-	u32 ramid    = 0x10;
-	u32 ramindex = (ramid << 24) + (way << 18) + (index << 6);
-	asm_ramindex_mcr(ramindex);
-	asm_ramindex_mrc(dl1data, 0x01);
+	uint64_t * capture = __scratch->capture;
+	int i, way, pos = 0;
+	uint8_t count;
+
+	for (i = sel.first_set; i < sel.last_set; i++) {
+		count = 0;
+		for (way = 0; way < geom.ways; way++) {
+			if (SEL_HAS_WAY(way) && PACKED_LINE_FILTERED(capture[i * geom.ways + way]))
+				++count;
+		}
+		other[pos++] = count;
+	}
 
-	// Check if MOESI state is invalid, and if so, zero out the address
-	if (((*dl1data) & 0x03UL) == 0) {
-		*dl1data = 0;
+	/* Keep the sections that follow aligned */
+	while (pos % sizeof(uint64_t))
+		other[pos++] = 0;
+
+	return pos;
+}
+
+/* Add the other section to a record, if filtering */
+static void append_other(struct sample_hdr * hdr)
+{
+	if (!(flags & DUMPCACHE_CMD_RESOLVE_EN_SHIFT) || filter.mode == FILTER_NONE)
 		return;
-	}
-	// Isolate the tag
-	*dl1data &= ~(0x03UL);
-	*dl1data <<= 12;
-	*dl1data |= (index << 5);
+
+	hdr->size += encode_other((uint8_t *)hdr + hdr->size);
+	hdr->flags |= SAMPLE_FLAG_OTHER;
 }
 
-bool rmap_one_func(struct page *page, struct vm_area_struct *vma, unsigned long addr, void *arg)
+/* Fill the details of a page cache or slab page. The other CPUs are
+ * running again: the page may have changed hands since its lines
+ * were classified, in which case only the class is reported.
+ *
+ * The page is pinned so that it cannot be freed and reused while it
+ * is looked at. A locked page cache page keeps its mapping, and the
+ * inode cannot be evicted before the page is removed from it. Slab
+ * pages cannot be locked: the cache name is copied optimistically,
+ * and dropped if the page left the cache meanwhile. The copy only
+ * reads the linear map, so a stale name is wrong, never fatal. */
+static void describe_kernel_page(struct kernel_page * entry)
 {
-        
-	struct mm_struct* mm;
-	struct task_struct* ts;
-	struct process_data
-	{
-		pid_t pid;
-		uint64_t addr;
-	};
+	struct kernel_page desc = *entry, * kp = &desc;
+	struct page * page = pfn_to_page(kp->pfn);
+	struct page * head = compound_head(page);
+	unsigned long mapping;
 
-	((struct process_data*) arg)->addr = 0;
+	kp->ino = 0;
+	kp->index = 0;
+	memset(kp->name, 0, sizeof(kp->name));
 
-	// Check if mm struct is null
-	mm = vma->vm_mm;
-	if (!mm) {
-		((struct process_data*) arg)->pid = (pid_t)99999;
-		return true;
-	}
+	if (!get_page_unless_zero(head))
+		goto out;
 
-	// Check if task struct is null
-	ts = mm->owner;
-	if (!ts) {
-		((struct process_data*) arg)->pid = (pid_t)99999;
-		return true;
-	}
+	/* The page may have been split or merged before the pin */
+	if (compound_head(page) != head)
+		goto put;
 
-	// If pid is 1, continue searching pages
-	if ((ts->pid) == 1) {
-		((struct process_data*) arg)->pid = (ts->pid);
-		return true;
+	if (kp->class == PAGE_CLASS_PAGECACHE) {
+		if (!trylock_page(head))
+			goto put;
+
+		mapping = (unsigned long)head->mapping;
+		if (mapping && !(mapping & PAGE_MAPPING_FLAGS)) {
+			struct inode * host = ((struct address_space *)mapping)->host;
+
+			if (host)
+				kp->ino = host->i_ino;
+			kp->index = page_to_pgoff(page);
+		}
+		unlock_page(head);
+	} else if (kp->class == PAGE_CLASS_SLAB && PageSlab(head)) {
+		struct kmem_cache * cache = READ_ONCE(head->slab_cache);
+
+		if (cache)
+			strncpy(kp->name, cache->name, sizeof(kp->name) - 1);
+
+		smp_rmb();
+		if (!PageSlab(head) || READ_ONCE(head->slab_cache) != cache)
+			memset(kp->name, 0, sizeof(kp->name));
 	}
 
-	// *Probably* the correct pid
-	((struct process_data*) arg)->pid = (ts->pid);
-	((struct process_data*) arg)->addr = addr;
-	return false;
+put:
+	put_page(head);
+out:
+	/* The section is uncached: no unaligned accesses */
+	memcpy_toio(entry, kp, sizeof(*kp));
 }
 
-int done_func(struct page *page)
+/* List the page cache and slab pages holding the captured lines in
+ * the kernel section. Returns the size of the section. */
+static uint32_t encode_kernel(struct kernel_section * section)
 {
-	return 1;
-} 
+	uint64_t * capture = __scratch->capture;
+	struct kernel_page_slot * slot;
+	struct kernel_page * kp;
+	unsigned long pfn;
+	uint32_t class, count = 0, dropped = 0;
+	uint64_t line;
+	int i, way;
+
+	memset(kernel_page_slots, 0, sizeof(kernel_page_slots));
+
+	for (i = sel.first_set; i < sel.last_set; i++) {
+		for (way = 0; way < geom.ways; way++) {
+			line = capture[i * geom.ways + way];
+			if (!line || !SEL_HAS_WAY(way))
+				continue;
+
+			class = PAGE_CLASS_OF(PACKED_LINE_PID(line));
+			if (class != PAGE_CLASS_PAGECACHE && class != PAGE_CLASS_SLAB)
+				continue;
+
+			pfn = PHYS_PFN(PACKED_LINE_ADDR(line));
+			slot = &kernel_page_slots[hash_long(pfn, KERNEL_PAGE_BITS)];
+			while (slot->entry && slot->pfn != pfn) {
+				if (++slot == &kernel_page_slots[KERNEL_PAGE_SLOTS])
+					slot = kernel_page_slots;
+			}
+
+			if (slot->entry) {
+				++section->pages[slot->entry - 1].lines;
+				continue;
+			}
+
+			if (count == MAX_KERNEL_PAGES) {
+				++dropped;
+				continue;
+			}
+
+			kp = &section->pages[count];
+			kp->pfn = pfn;
+			kp->class = class;
+			kp->lines = 1;
+			slot->pfn = pfn;
+			slot->entry = ++count;
+		}
+	}
 
+	for (i = 0; i < count; i++)
+		describe_kernel_page(&section->pages[i]);
 
-bool invalid_func(struct vm_area_struct *vma, void *arg)
-{
-	struct process_data
-	{
-		pid_t pid;
-		uint64_t addr;
-	};
+	section->count = count;
+	section->dropped = dropped;
 
-	((struct process_data*) arg)->pid = (pid_t)99999;
-	return false;
-} 
+	return KERNEL_SECTION_SIZE(count);
+}
 
-static int __dump_index_resolve(int index, struct cache_set* buf)
+/* Add the kernel section to a record, if classifying */
+static void append_kernel(struct sample_hdr * hdr)
 {
-	int way;
-	u32 physical_address;
-	struct page* derived_page;
-	struct rmap_walk_control rwc;
-	struct rmap_walk_control * rwc_p;
+	if (!(flags & DUMPCACHE_CMD_RESOLVE_EN_SHIFT) ||
+	    !(flags & DUMPCACHE_CMD_CLASSIFY_EN_SHIFT))
+		return;
 
-	/* This will be used to invoke address resolution */
-	struct cache_line process_data_struct;
-		
-	// Instantiate rmap walk control struct
-	rwc.arg = &process_data_struct;
-	rwc.rmap_one = rmap_one_func;
-	rwc.done = NULL; //done_func;
-	rwc.anon_lock = NULL;
-	rwc.invalid_vma = invalid_func;
-	rwc_p = &rwc;
+	hdr->size += encode_kernel((struct kernel_section *)((char *)hdr + hdr->size));
+	hdr->flags |= SAMPLE_FLAG_KERNEL;
+}
 
-	for (way = 0; way < WAYS; way++) {
-		get_tag(index, way, &physical_address);
-		if (!physical_address)
-			continue;
+/* Record the selection and resolution state in a header */
+static inline void fill_hdr(struct sample_hdr * hdr, uint32_t magic,
+			    uint32_t size, uint32_t count)
+{
+	hdr->magic = magic;
+	hdr->size = size;
+	hdr->entries = count;
+	hdr->flags = (flags & DUMPCACHE_CMD_RESOLVE_EN_SHIFT) ? SAMPLE_FLAG_RESOLVED : 0;
+	hdr->first_set = sel.first_set;
+	hdr->last_set = sel.last_set;
+	hdr->way_mask = sel.way_mask;
+	hdr->stall_policy = stall.policy;
+	hdr->stalled = stalled_cpus;
+}
+
+/* Describe a full sample in the header that follows its lines */
+static void fill_full_hdr(struct cache_line * sample, uint32_t valid)
+{
+	struct sample_hdr * hdr = (struct sample_hdr *)
+		((char *)sample + l2_sample_size - sizeof(struct sample_hdr));
 
-		derived_page = phys_to_page(((u64)physical_address << 1));
+	fill_hdr(hdr, SAMPLE_MAGIC_FULL, sample_size, valid);
 
-		// Initalize struct
-		(buf->cachelines[way]).pid = 0; //process_data_struct->pid;// = 0;
-		(buf->cachelines[way]).addr = ((u64)physical_address << 1); //process_data_struct->addr;// = 0;
+	if (flags & DUMPCACHE_CMD_CORES_EN_SHIFT)
+		hdr->flags |= SAMPLE_FLAG_CORES;
+	if (flags & DUMPCACHE_CMD_PMU_EN_SHIFT)
+		hdr->flags |= SAMPLE_FLAG_PMU;
+	if (flags & DUMPCACHE_CMD_TIMESTAMP_EN_SHIFT)
+		hdr->flags |= SAMPLE_FLAG_TIMING;
+}
 
-		/* Reset address */
-		process_data_struct.addr = 0;
+/* Encode the captured lines in the packed format. If a shadow array
+ * is passed, it is refreshed with the content of every (set, way).
+ * Pairs outside of the selection are stored as invalid. */
+static void encode_packed(struct packed_sample * sample, uint64_t * shadow)
+{
+	int i, way;
+	uint64_t line;
+	uint16_t valid;
+	uint32_t count = 0;
+	uint64_t * lines = PACKED_LINES(sample, geom.sets);
+	
+	for (i = 0; i < geom.sets; i++) {
+		valid = 0;
 		
-	        // This call populates the struct in rwc struct
-		rmap_walk_func(derived_page, rwc_p);
+		for (way = 0; way < geom.ways; way++) {
+			line = 0;
+			if (i >= sel.first_set && i < sel.last_set && SEL_HAS_WAY(way))
+				line = __scratch->capture[i * geom.ways + way];
+
+			/* Filtered lines only show up in the other section */
+			line = STORED_LINE(line);
+
+			if (shadow)
+				shadow[i * geom.ways + way] = line;
+			
+			if (!line)
+				continue;
+
+			lines[count++] = line;
+			valid |= (1 << way);
+		}
 
-		// Fill cacheline struct with values obtained from rmap_walk_func
-		(buf->cachelines[way]).pid = process_data_struct.pid;
-		if(process_data_struct.addr != 0) {
-#if FULL_ADDRESS == 0
-			(buf->cachelines[way]).addr = process_data_struct.addr;
-#else
-			(buf->cachelines[way]).addr = process_data_struct.addr | (((u64)physical_address << 1) & 0xfff);
-#endif			
+		sample->valid[i] = valid;
+	}
+
+	fill_hdr(&sample->hdr, SAMPLE_MAGIC_PACKED, PACKED_SAMPLE_SIZE(geom.sets, count), count);
+	append_other(&sample->hdr);
+	append_kernel(&sample->hdr);
+}
+
+/* Encode only the (set, way) pairs whose captured content differs
+ * from the shadow copy of the previous sample. Changed lines are
+ * stored first, then a second pass stores their positions and
+ * refreshes the shadow. Only the selection is compared: the keyframe
+ * left the rest of the shadow invalid. */
+static void encode_delta(struct delta_sample * sample)
+{
+	int pos, way;
+	uint16_t * positions;
+	uint32_t count = 0;
+	uint64_t * shadow = __scratch->shadow;
+	uint64_t * capture = __scratch->capture;
+	const int first = sel.first_set * geom.ways;
+	const int last = sel.last_set * geom.ways;
+	
+	for (pos = first, way = 0; pos < last; pos++, way = (way + 1) % geom.ways) {
+		if (SEL_HAS_WAY(way) && STORED_LINE(capture[pos]) != shadow[pos])
+			sample->lines[count++] = STORED_LINE(capture[pos]);
+	}
+
+	positions = (uint16_t *)&sample->lines[count];
+	for (pos = first, way = 0, count = 0; pos < last; pos++, way = (way + 1) % geom.ways) {
+		if (SEL_HAS_WAY(way) && STORED_LINE(capture[pos]) != shadow[pos]) {
+			positions[count++] = pos;
+			shadow[pos] = STORED_LINE(capture[pos]);
 		}
 	}
-       
-	return 0;
+
+	fill_hdr(&sample->hdr, SAMPLE_MAGIC_DELTA, DELTA_SAMPLE_SIZE(count), count);
+	append_other(&sample->hdr);
+	append_kernel(&sample->hdr);
 }
 
-static int __dump_index_noresolve(int index, struct cache_set* buf)
+/* Add lines to the entry of an owner in an aggregation table. Once
+ * the table is full, new owners are accounted to AGGREGATE_ID_OTHER,
+ * which always finds a free entry. Returns the entries in use. */
+static uint32_t aggregate_add(struct aggregate_owner * table, uint32_t count,
+			      uint32_t id, uint32_t lines)
 {
-	int way;
-	u32 physical_address;
+	u32 slot;
 
-	for (way = 0; way < WAYS; way++) {
-		get_tag(index, way, &physical_address);
-		if (!physical_address)
-			continue;
-		
-		// Initalize struct
-		(buf->cachelines[way]).pid = 0; //process_data_struct->pid;// = 0;
-		(buf->cachelines[way]).addr = ((u64)physical_address); //process_data_struct->addr;// = 0;
-		
+again:
+	slot = hash_32(id, AGGREGATE_BITS);
+	while (table[slot].lines && table[slot].id != id)
+		slot = (slot + 1) & (AGGREGATE_SLOTS - 1);
+
+	if (!table[slot].lines) {
+		if (count >= MAX_AGGREGATE_OWNERS - 1 && id != AGGREGATE_ID_OTHER) {
+			id = AGGREGATE_ID_OTHER;
+			goto again;
+		}
+
+		table[slot].id = id;
+		++count;
 	}
-       
-	return 0;
+
+	table[slot].lines += lines;
+	return count;
 }
 
-/* Invoke a smaller-footprint function in case address resolution has
- * not been requested */
-static int dump_index(int index, struct cache_set* buf)
+/* Id of the cgroup v2 of a process, 0 if there is no such process */
+static uint32_t owner_cgroup(pid_t nr)
 {
-	if (flags & DUMPCACHE_CMD_RESOLVE_EN_SHIFT)
-		return __dump_index_resolve(index, buf);
-	else
-		return __dump_index_noresolve(index, buf);
+	struct task_struct * task;
+	uint32_t id = 0;
+
+	if (nr <= 0 || nr == RMAP_FAILED_PID)
+		return 0;
+
+	/* Kernel pages have no cgroup: keep them apart */
+	if (PAGE_CLASS_OF(nr))
+		return nr;
+
+	rcu_read_lock();
+	task = pid_task(find_pid_ns(nr, &init_pid_ns), PIDTYPE_PID);
+	if (task)
+		id = cgroup_ino(task_dfl_cgroup(task));
+	rcu_read_unlock();
+
+	return id;
 }
 
-static int dump_all_indices(void) {
-	int i = 0;
-	for (i = 0; i < CACHESETS_TO_WRITE; i++) {
-		if (dump_index(i, &cur_sample->sets[i]) == 1){
-			//printk(KERN_INFO "Error dumping index: %d", i);
-			return 1;
+/* Summarize the captured lines: valid lines per set and per color,
+ * and lines per owner. Runs of lines of the same owner, common within
+ * a set, are added to the table in one go. */
+static void encode_aggregate(struct aggregate_sample * sample)
+{
+	struct aggregate_owner * table = agg_tables[0];
+	struct aggregate_owner * owners;
+	uint32_t colors[MAX_CACHESETS / AGGREGATE_COLOR_SETS] = { 0 };
+	uint32_t * dst;
+	uint32_t count = 0, valid = 0, filtered = 0, run = 0;
+	pid_t pid, run_pid = 0;
+	uint64_t line;
+	uint8_t lines;
+	int i, way;
+
+	memset(agg_tables, 0, sizeof(agg_tables));
+
+	sample->sets = sel.last_set - sel.first_set;
+	sample->colors = geom.sets / AGGREGATE_COLOR_SETS;
+
+	for (i = sel.first_set; i < sel.last_set; i++) {
+		lines = 0;
+
+		for (way = 0; way < geom.ways; way++) {
+			line = __scratch->capture[i * geom.ways + way];
+			if (!line || !SEL_HAS_WAY(way))
+				continue;
+
+			++lines;
+			if (PACKED_LINE_FILTERED(line)) {
+				++filtered;
+				continue;
+			}
+
+			pid = PACKED_LINE_PID(line);
+			if (run && pid != run_pid) {
+				count = aggregate_add(table, count, run_pid, run);
+				run = 0;
+			}
+			run_pid = pid;
+			++run;
 		}
+
+		sample->set_valid[i - sel.first_set] = lines;
+		colors[i / AGGREGATE_COLOR_SETS] += lines;
+		valid += lines;
 	}
-	return 0;
+
+	if (run)
+		count = aggregate_add(table, count, run_pid, run);
+
+	/* Fold processes into their cgroups */
+	if (flags & DUMPCACHE_CMD_AGG_CGROUPS_EN_SHIFT) {
+		struct aggregate_owner * pids = table;
+		uint32_t id;
+
+		table = agg_tables[1];
+		for (i = 0, count = 0; i < AGGREGATE_SLOTS; i++) {
+			if (!pids[i].lines)
+				continue;
+
+			id = pids[i].id;
+			if (id != AGGREGATE_ID_OTHER)
+				id = owner_cgroup(id);
+			count = aggregate_add(table, count, id, pids[i].lines);
+		}
+	}
+
+	/* Padding included, so that records are reproducible */
+	for (i = sample->sets; i < ALIGN(sample->sets, 8); i++)
+		sample->set_valid[i] = 0;
+
+	dst = AGGREGATE_COLORS(sample);
+	for (i = 0; i < ALIGN(sample->colors, 2); i++)
+		dst[i] = colors[i];
+
+	owners = AGGREGATE_OWNERS(sample);
+	for (i = 0, count = 0; i < AGGREGATE_SLOTS; i++) {
+		if (table[i].lines)
+			owners[count++] = table[i];
+	}
+
+	sample->valid = valid;
+	sample->filtered = filtered;
+	sample->reserved = 0;
+
+	fill_hdr(&sample->hdr, SAMPLE_MAGIC_AGGREGATE,
+		 AGGREGATE_SAMPLE_SIZE(sample->sets, sample->colors, count), count);
+	if (flags & DUMPCACHE_CMD_AGG_CGROUPS_EN_SHIFT)
+		sample->hdr.flags |= SAMPLE_FLAG_CGROUPS;
 }
 
 /* ProcFS interface definition */
@@ -501,13 +3328,103 @@ static int dumpcache_open(struct inode *inode, struct file *filp)
 	return ret;
 }
 
+/* Map the sample apertures read-only into user space. The part of
+ * aperture 1 that holds samples is immediately followed by aperture 2
+ * in the mapping, so that the i-th sample (as in sample_from_index)
+ * sits at offset i * sample_size. */
+static int dumpcache_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long len1 = CACHE_BUF_LEN1;
+	unsigned long len2 = CACHE_BUF_LEN2;
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned long uaddr = vma->vm_start;
+	unsigned long chunk;
+	int ret = 0;
+
+	/* Samples can only be inspected, never modified */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	/* With sections enabled, the ring does not end on a page
+	 * boundary: accept the page the last sample ends in. The rest
+	 * of that page is unused, as the scratch area starts on the
+	 * next page boundary. */
+	if (off > len1 + len2 || len > PAGE_ALIGN(len1 + len2) - off)
+		return -EINVAL;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+
+	/* Uncached like the kernel-side ioremap, but Normal memory:
+	 * user space reads samples with memcpy, unaligned and paired
+	 * loads, which fault or are undefined on Device memory */
+	vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+
+	/* Part of the request that falls in aperture 1 */
+	if (off < len1) {
+		chunk = min(len, len1 - off);
+		ret = remap_pfn_range(vma, uaddr, PHYS_PFN(CACHE_BUF_BASE1 + off),
+				      chunk, vma->vm_page_prot);
+		if (ret)
+			return ret;
+
+		uaddr += chunk;
+		len -= chunk;
+		off = len1;
+	}
+
+	/* Rest of the request falls in aperture 2 */
+	if (len) {
+		ret = remap_pfn_range(vma, uaddr, PHYS_PFN(CACHE_BUF_BASE2 + off - len1),
+				      len, vma->vm_page_prot);
+	}
+	
+	return ret;
+}
+
 int init_module(void)
 {
+	int ret;
+	
 	//printk(KERN_INFO "dumpcache module is loaded\n");
 	dump_all_indices_done = 0;
 
-	pr_info("Initializing SHUTTER. Entries: Aperture1 = %ld, Aperture2 = %ld\n",
-	       CACHE_BUF_COUNT1, CACHE_BUF_COUNT2);
+	/* Find out what the L2 looks like on this CPU */
+	preempt_disable();
+	ret = probe_geometry(&geom);
+	preempt_enable();
+
+	if (ret || geom.line_size != 64 || geom.ways > MAX_WAYS ||
+	    geom.sets != TAG_SETS || geom.sets % DUMP_CHUNK_SETS) {
+		pr_err("Unsupported L2 geometry: %u sets, %u ways, %u-byte lines.\n",
+		       geom.sets, geom.ways, geom.line_size);
+		return -ENODEV;
+	}
+
+	l2_sample_size = geom.sets * geom.ways * sizeof(struct cache_line) +
+		sizeof(struct sample_hdr);
+	sample_size = l2_sample_size;
+
+	/* Stall every other CPU by default */
+	stall.policy = STALL_POLICY_ALL;
+	
+	/* Capture the whole L2 by default */
+	sel.first_set = 0;
+	sel.last_set = geom.sets;
+	sel.way_mask = ALL_WAYS;
+
+	/* Pick the dump loops built for this number of ways */
+	if (geom.ways == 16)
+		loops = &dump_loops_16;
+	else if (geom.ways == 8)
+		loops = &dump_loops_8;
+	else
+		loops = &dump_loops_generic;
+
+	pr_info("Initializing SHUTTER. L2: %u KB, %u sets, %u ways. "
+		"Entries: Aperture1 = %ld, Aperture2 = %ld\n",
+		geom.size / 1024, geom.sets, geom.ways, CACHE_BUF_COUNT1, CACHE_BUF_COUNT2);
 
 	/* Resolve the rmap_walk_func required to resolve physical
 	 * address to virtual addresses */
@@ -525,21 +3442,82 @@ int init_module(void)
 			return -ENOSYS;
 		}
 	}
+
+	/* Pids from PACKED_PID_LIMIT on would be taken for the
+	 * pseudo-pids of packed lines */
+	if (!pid_max_ptr) {
+		preempt_disable();
+		mutex_lock(&module_mutex);
+		pid_max_ptr = (void*) kallsyms_lookup_name("pid_max");
+		mutex_unlock(&module_mutex);
+		preempt_enable();
+
+		if (!pid_max_ptr) {
+			pr_err("Unable to find pid_max symbol. Aborting.\n");
+			return -ENOSYS;
+		}
+	}
+
+	if (*pid_max_ptr > PACKED_PID_LIMIT) {
+		pr_err("pid_max is %d, but packed lines only hold pids below %d. "
+		       "Lower kernel.pid_max. Aborting.\n", *pid_max_ptr, PACKED_PID_LIMIT);
+		return -ERANGE;
+	}
+
+	/* Deferred resolution runs with the other CPUs released */
+	if (!rmap_walk_locking_func) {
+		preempt_disable();
+		mutex_lock(&module_mutex);
+		rmap_walk_locking_func = (void*) kallsyms_lookup_name("rmap_walk");
+		mutex_unlock(&module_mutex);
+		preempt_enable();
+
+		if (!rmap_walk_locking_func) {
+			pr_err("Unable to find rmap_walk symbol. Aborting.\n");
+			return -ENOSYS;
+		}
+	}
+
+	/* PMU counters are optional: only complain if missing */
+	if (!perf_read_local_func) {
+		preempt_disable();
+		mutex_lock(&module_mutex);
+		perf_read_local_func = (void*) kallsyms_lookup_name("perf_event_read_local");
+		mutex_unlock(&module_mutex);
+		preempt_enable();
+
+		if (!perf_read_local_func)
+			pr_warn("Unable to find perf_event_read_local symbol. No PMU counters.\n");
+	}
 	
 	/* Map buffer apertures to be accessible from kernel mode */
-	__buf_start1 = (struct cache_sample *) ioremap_nocache(CACHE_BUF_BASE1, CACHE_BUF_SIZE1);
-	__buf_start2 = (struct cache_sample *) ioremap_nocache(CACHE_BUF_BASE2, CACHE_BUF_SIZE2);
+	__buf_start1 = ioremap_nocache(CACHE_BUF_BASE1, CACHE_BUF_SIZE1);
+	__buf_start2 = ioremap_nocache(CACHE_BUF_BASE2, CACHE_BUF_SIZE2);
 
 	/* Check that we are all good! */
 	if(/*!__buf_start1 ||*/ !__buf_start2) {
 		pr_err("Unable to io-remap buffer space.\n");
 		return -ENOMEM;
 	}
+
+	/* Scratch area sits right after the last sample of aperture 2 */
+	__scratch = (struct dumpcache_scratch *)
+		((char *)__buf_start2 + CACHE_BUF_SIZE2 - CACHE_SCRATCH_SIZE);
+
+	/* Whatever is left in the memo tables is garbage */
+	BUILD_BUG_ON(DUMP_CHUNK_SETS * 64 < PAGE_SIZE);
+	BUILD_BUG_ON(DUMP_CHUNK_SETS * MAX_WAYS * 2 > MEMO_SLOTS);
+	memset_io(__scratch->memo, 0, sizeof(__scratch->memo));
+	memo_gen = 1;
 	
 	/* Set default flags, counter, and current sample buffer */
 	flags = 0;
 	cur_buf = 0;
+	cur_off = 0;
 	cur_sample = sample_from_index(0);
+	ring_reset(0);
+	keyframe_period = DELTA_KEYFRAME_PERIOD;
+	keyframe_countdown = 0;
 	
 	/* Setup proc interface */
 	proc_create(MODNAME, 0644, NULL, &dumpcache_fops);
@@ -549,6 +3527,18 @@ int init_module(void)
 void cleanup_module(void)
 {
 	//printk(KERN_INFO "dumpcache module is unloaded\n");
+	mutex_lock(&sampler_mutex);
+	trigger_stop();
+	sampler_config(0);
+	mutex_unlock(&sampler_mutex);
+	pmu_stop();
+
+	while (target_count)
+		put_pid(targets[--target_count]);
+
+	if (filter_cgroup)
+		cgroup_put(filter_cgroup);
+	
 	if(__buf_start1) {
 		iounmap(__buf_start1);
 		__buf_start1 = NULL;
@@ -562,5 +3552,4 @@ void cleanup_module(void)
 	remove_proc_entry(MODNAME, NULL);
 }
 
-#pragma GCC pop_options
 MODULE_LICENSE("GPL");
@@ -0,0 +1,51 @@
+/*************************************************************/
+/*                                                           */
+/*  Binary capture file written by snapshot -b: one file     */
+/*  per run, holding the samples exactly as stored by the    */
+/*  module. capture2csv turns it into the CSV layout.        */
+/*  Include after params.h.                                  */
+/*                                                           */
+/*************************************************************/
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#define CAPTURE_FILENAME     "capture.bin"
+#define CAPTURE_MAGIC        "SHUTCAP"
+#define CAPTURE_VERSION      4
+
+/* How the samples of a capture are laid out */
+#define CAPTURE_FORMAT_FULL    0	/* Full samples, then the sections */
+#define CAPTURE_FORMAT_RECORDS 1	/* Variable-size records, sample_hdr first */
+
+/* Start of the file, describing the run */
+struct capture_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t size;		/* Of this header, records follow */
+	struct cache_geometry geom;
+	struct dump_selection sel;
+	uint32_t format;
+	uint64_t config;	/* Configuration command sent to the module */
+	uint32_t sections;	/* Full format: SAMPLE_FLAG_* of the sections */
+	uint32_t period_us;	/* Sampling period, 0 if not periodic */
+	uint32_t benchmarks;	/* Number of benchmarks launched */
+	uint32_t reserved;
+	uint64_t start;		/* CLOCK_MONOTONIC at the start of the run, in ns */
+};
+
+/* Precedes each sample */
+struct capture_record
+{
+	uint32_t size;		/* Of the sample that follows */
+	uint32_t index;		/* Samples saved before this one */
+	uint64_t timestamp;	/* CLOCK_MONOTONIC when it was acquired, in ns */
+};
+
+/* The timestamp of a record is the start of its timing section if
+ * there is one. Otherwise it is taken by snapshot right before asking
+ * for the sample, or when the sample was drained from the ring if
+ * the module acquired it on its own. */
+
+#endif
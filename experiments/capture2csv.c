@@ -0,0 +1,120 @@
+/*************************************************************/
+/*                                                           */
+/*  Convert a binary capture file written by snapshot -b     */
+/*  into one cachedump<n>.csv file per sample, along with    */
+/*  the other CSV files the plot scripts expect.             */
+/*                                                           */
+/*************************************************************/
+
+#define _GNU_SOURCE
+#include "params.h"
+#include "samples.h"
+#include "csv.h"
+#include "capture.h"
+#include <getopt.h>
+
+#define USAGE_STR "Usage: %s [-M] capture_file output_dir\n"	\
+	"Options:\n"							\
+	"-M\tAdd the coherence state bits of each line as a third CSV column.\n"
+
+/* Read exactly len bytes. Returns 0 at the end of the file. */
+static int read_full(FILE * in, void * buf, size_t len)
+{
+	size_t done = fread(buf, 1, len, in);
+
+	if (done == len)
+		return 1;
+
+	if (done != 0 || ferror(in)) {
+		fprintf(stderr, "Truncated capture file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}
+
+int main (int argc, char ** argv)
+{
+	struct csv_options opts = { 0, 0 };
+	struct capture_header hdr;
+	struct capture_record rec;
+	struct sample_state st;
+	char pathname[PATH_MAX];
+	size_t max_size = 0;
+	char * sample = NULL;
+	FILE * in;
+	int opt, count = 0;
+
+	while ((opt = getopt(argc, argv, "M")) != -1) {
+		switch (opt) {
+		case 'M':
+			opts.state = 1;
+			break;
+		default:
+			fprintf(stderr, USAGE_STR, argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind != 2) {
+		fprintf(stderr, USAGE_STR, argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!(in = fopen(argv[optind], "r"))) {
+		perror("Unable to open capture file");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Newer headers may be larger: skip what we do not know */
+	if (!read_full(in, &hdr, sizeof(hdr)) ||
+	    memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != CAPTURE_VERSION || hdr.size < sizeof(hdr)) {
+		fprintf(stderr, "Not a capture file\n");
+		exit(EXIT_FAILURE);
+	}
+	fseek(in, hdr.size, SEEK_SET);
+
+	mkdir(argv[optind + 1], 0700);
+	write_geometry_file(argv[optind + 1], &hdr.geom);
+
+	if (sample_state_init(&st, &hdr.geom) < 0) {
+		perror("Unable to allocate sample state");
+		exit(EXIT_FAILURE);
+	}
+
+	while (read_full(in, &rec, sizeof(rec))) {
+		if (rec.size > max_size) {
+			max_size = rec.size;
+			if (!(sample = (char *)realloc(sample, max_size))) {
+				perror("Unable to allocate sample");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (!read_full(in, sample, rec.size)) {
+			fprintf(stderr, "Truncated capture file\n");
+			exit(EXIT_FAILURE);
+		}
+
+		snprintf(pathname, PATH_MAX, "%s/cachedump%u.csv", argv[optind + 1], rec.index);
+
+		if (hdr.format == CAPTURE_FORMAT_FULL) {
+			write_full_to_csv(pathname, sample, &hdr.geom, hdr.sections, &opts);
+		} else if (write_record_to_csv(pathname, &st, (struct sample_hdr *)sample,
+					       &opts) < 0) {
+			fprintf(stderr, "Invalid record for sample %u\n", rec.index);
+			exit(EXIT_FAILURE);
+		}
+
+		++count;
+	}
+
+	printf("Converted %d samples\n", count);
+
+	free(sample);
+	sample_state_free(&st);
+	fclose(in);
+
+	return EXIT_SUCCESS;
+}
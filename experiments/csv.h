@@ -0,0 +1,410 @@
+/*************************************************************/
+/*                                                           */
+/*  Writers of the CSV layout expected by the plot scripts,  */
+/*  shared by snapshot and capture2csv. Include after        */
+/*  samples.h.                                               */
+/*                                                           */
+/*************************************************************/
+
+#ifndef __CSV_H__
+#define __CSV_H__
+
+#include <limits.h>
+#include <string.h>
+
+#define GEOMETRY_FILENAME    "geometry.txt"
+
+/* How samples are written out */
+struct csv_options
+{
+	int state;		/* Add the coherence state as a third column */
+	int sync;		/* Open the CSV files of the L2 with O_SYNC */
+};
+
+/* Path of a file shared by all the samples, in the same directory
+ * as the CSV file of a sample */
+static inline void csv_sibling(char * pathname, const char * filename, const char * name)
+{
+	const char * slash = strrchr(filename, '/');
+
+	if (slash)
+		snprintf(pathname, PATH_MAX, "%.*s/%s", (int)(slash - filename), filename, name);
+	else
+		snprintf(pathname, PATH_MAX, "%s", name);
+}
+
+/* Describe the L2 that the samples in dir come from, for the plot
+ * scripts: the number of sets, then of ways, one per line */
+static inline void write_geometry_file(const char * dir, const struct cache_geometry * geom)
+{
+	char pathname[PATH_MAX];
+	FILE * out;
+
+	snprintf(pathname, PATH_MAX, "%s/" GEOMETRY_FILENAME, dir);
+	if (!(out = fopen(pathname, "w"))) {
+		perror("Unable to write geometry file");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(out, "%u\n%u\n", geom->sets, geom->ways);
+	fclose(out);
+}
+
+/* Append one line to the CSV buffer and flush it out when full */
+static inline int csv_append(int outfile, char * csv_file_buf, int bytes_to_write,
+			     pid_t pid, uint64_t addr, uint32_t state,
+			     const struct csv_options * opts)
+{
+	if (opts->state)
+		bytes_to_write += sprintf(csv_file_buf + bytes_to_write,
+					  "%05d,0x%012lx,%u\n", pid, addr, state);
+	else
+		bytes_to_write += sprintf(csv_file_buf + bytes_to_write,
+					  "%05d,0x%012lx\n", pid, addr);
+			
+	/* Flush out pending data */			
+	if (bytes_to_write >= WRITE_SIZE){				
+		if (write(outfile, csv_file_buf, bytes_to_write) == -1) {
+			perror("Failed to write to outfile");
+		}
+		bytes_to_write = 0;
+	}
+
+	return bytes_to_write;
+}
+
+/* Save the raw entries of the private arrays of each core next to
+ * the CSV file of the L2 */
+static void write_cores_to_file(const char * filename, const struct core_sample * cores)
+{
+	static char pathname[PATH_MAX];
+	FILE * out;
+	int c, i;
+
+	snprintf(pathname, PATH_MAX, "%.*s-cores.csv", (int)strlen(filename) - 4, filename);
+	if (!(out = fopen(pathname, "w"))) {
+		perror("Failed to open cores file");
+		exit(EXIT_FAILURE);
+	}
+
+	/* cpu, array, entry, raw DATA1:DATA0, raw DATA3:DATA2 */
+	for (c = 0; c < MAX_CLUSTER_CPUS; c++) {
+		const struct core_sample * core = &cores[c];
+
+		if (core->cpu == ~0U)
+			continue;
+
+		for (i = 0; i < L1D_SETS * L1D_WAYS; i++)
+			fprintf(out, "%u,l1d,%d,0x%016lx,0x0\n", core->cpu, i, core->l1d_tags[i]);
+		for (i = 0; i < L1I_SETS * L1I_WAYS; i++)
+			fprintf(out, "%u,l1i,%d,0x%016lx,0x0\n", core->cpu, i, core->l1i_tags[i]);
+		for (i = 0; i < L1D_TLB_ENTRIES; i++)
+			fprintf(out, "%u,l1dtlb,%d,0x%016lx,0x%016lx\n", core->cpu, i,
+				core->l1d_tlb[2 * i], core->l1d_tlb[2 * i + 1]);
+		for (i = 0; i < L2_TLB_SETS * L2_TLB_WAYS; i++)
+			fprintf(out, "%u,l2tlb,%d,0x%016lx,0x%016lx\n", core->cpu, i,
+				core->l2_tlb[2 * i], core->l2_tlb[2 * i + 1]);
+	}
+
+	fclose(out);
+}
+
+/* Save the number of filtered lines of each set next to the CSV file
+ * of the L2 */
+static void write_other_to_file(const char * filename, const struct sample_hdr * hdr,
+			 const uint8_t * other)
+{
+	static char pathname[PATH_MAX];
+	FILE * out;
+	int set;
+
+	snprintf(pathname, PATH_MAX, "%.*s-other.csv", (int)strlen(filename) - 4, filename);
+	if (!(out = fopen(pathname, "w"))) {
+		perror("Failed to open other file");
+		exit(EXIT_FAILURE);
+	}
+
+	for (set = hdr->first_set; set < hdr->last_set; set++) {
+		if (other[set - hdr->first_set])
+			fprintf(out, "%d,%u\n", set, other[set - hdr->first_set]);
+	}
+
+	fclose(out);
+}
+
+/* Save the page cache and slab pages holding lines next to the CSV
+ * file of the L2 */
+static void write_kernel_to_file(const char * filename, const struct kernel_section * section)
+{
+	static char pathname[PATH_MAX];
+	FILE * out;
+	uint32_t i;
+
+	snprintf(pathname, PATH_MAX, "%.*s-kernel.csv", (int)strlen(filename) - 4, filename);
+	if (!(out = fopen(pathname, "w"))) {
+		perror("Failed to open kernel file");
+		exit(EXIT_FAILURE);
+	}
+
+	/* pfn, kind, lines, inode, offset in pages, slab cache */
+	for (i = 0; i < section->count; i++) {
+		const struct kernel_page * kp = &section->pages[i];
+
+		fprintf(out, "0x%lx,%s,%u,%lu,%lu,%.*s\n", kp->pfn,
+			kp->class == PAGE_CLASS_SLAB ? "slab" : "pagecache", kp->lines,
+			kp->ino, kp->index, KERNEL_NAME_LEN, kp->name);
+	}
+
+	/* Lines of the pages that did not fit */
+	if (section->dropped)
+		fprintf(out, "0x0,dropped,%u,0,0,\n", section->dropped);
+
+	fclose(out);
+}
+
+/* Append the timing of a snapshot to timing.csv, next to the CSV
+ * file of the L2. Rows are flushed right away, so that they survive an
+ * interrupted capture. */
+static void write_timing_to_file(const char * filename, const struct sample_timing * t)
+{
+	static FILE * out = NULL;
+	static char pathname[PATH_MAX];
+	const char * name = strrchr(filename, '/');
+	int i;
+
+	if (!out) {
+		csv_sibling(pathname, filename, "timing.csv");
+		if (!(out = fopen(pathname, "w"))) {
+			perror("Failed to open timing file");
+			exit(EXIT_FAILURE);
+		}
+
+		fprintf(out, "sample,cpu,freq,start,end,start_ns,end_ns,dump,resolve,valid,rmap_failures");
+		for (i = 0; i < MAX_STALL_CPUS; i++)
+			fprintf(out, ",stall%d", i);
+		fprintf(out, "\n");
+	}
+
+	/* Stalls of CPUs that were not interrupted are left empty */
+	fprintf(out, "%s,%u,%u,%lu,%lu,%lu,%lu,%u,%u,%u,%u", name ? name + 1 : filename,
+		t->cpu, t->freq, t->start, t->end, t->start_ns, t->end_ns, t->dump, t->resolve,
+		t->valid, t->rmap_failures);
+	for (i = 0; i < MAX_STALL_CPUS; i++) {
+		if (t->stall[i] == ~0U)
+			fprintf(out, ",");
+		else
+			fprintf(out, ",%u", t->stall[i]);
+	}
+	fprintf(out, "\n");
+	fflush(out);
+}
+
+/* Append the PMU counters read with a snapshot to pmu.csv, next to
+ * the CSV file of the L2. Totals are running: consecutive rows of the same
+ * CPU and event have to be subtracted. */
+static void write_pmu_to_file(const char * filename, const struct pmu_sample * pmu)
+{
+	static FILE * out = NULL;
+	static char pathname[PATH_MAX];
+	const char * name = strrchr(filename, '/');
+	int cpu, i;
+
+	if (!out) {
+		csv_sibling(pathname, filename, "pmu.csv");
+		if (!(out = fopen(pathname, "w"))) {
+			perror("Failed to open PMU file");
+			exit(EXIT_FAILURE);
+		}
+
+		fprintf(out, "sample,cpu,event,count\n");
+	}
+
+	for (cpu = 0; cpu < MAX_STALL_CPUS; cpu++) {
+		for (i = 0; i < MAX_PMU_EVENTS; i++) {
+			if (pmu->events[i] == PMU_EVENT_NONE || pmu->counts[cpu][i] == ~0UL)
+				continue;
+
+			fprintf(out, "%s,%d,0x%x,%lu\n", name ? name + 1 : filename,
+				cpu, pmu->events[i], pmu->counts[cpu][i]);
+		}
+	}
+	fflush(out);
+}
+
+/* Append an occupancy summary to occupancy.csv, next to the CSV
+ * file of the L2: valid lines of each non-empty set and of each color,
+ * then lines of each owner */
+static void write_aggregate_to_file(const char * filename, const struct aggregate_sample * sample)
+{
+	static FILE * out = NULL;
+	static char pathname[PATH_MAX];
+	const char * name = strrchr(filename, '/');
+	const uint32_t * colors = AGGREGATE_COLORS(sample);
+	const struct aggregate_owner * owners = AGGREGATE_OWNERS(sample);
+	const char * owner = (sample->hdr.flags & SAMPLE_FLAG_CGROUPS) ? "cgroup" : "pid";
+	uint32_t i;
+
+	if (!out) {
+		csv_sibling(pathname, filename, "occupancy.csv");
+		if (!(out = fopen(pathname, "w"))) {
+			perror("Failed to open occupancy file");
+			exit(EXIT_FAILURE);
+		}
+
+		fprintf(out, "sample,kind,index,lines\n");
+	}
+
+	name = name ? name + 1 : filename;
+	fprintf(out, "%s,valid,0,%u\n", name, sample->valid);
+	fprintf(out, "%s,filtered,0,%u\n", name, sample->filtered);
+
+	for (i = 0; i < sample->sets; i++) {
+		if (sample->set_valid[i])
+			fprintf(out, "%s,set,%u,%u\n", name,
+				sample->hdr.first_set + i, sample->set_valid[i]);
+	}
+
+	for (i = 0; i < sample->colors; i++)
+		fprintf(out, "%s,color,%u,%u\n", name, i, colors[i]);
+
+	/* Owners in excess are reported as -1 */
+	for (i = 0; i < sample->hdr.entries; i++)
+		fprintf(out, "%s,%s,%d,%u\n", name, owner, (int)owners[i].id, owners[i].lines);
+
+	fflush(out);
+}
+
+/* Save the sections that may follow the content of a record */
+static void write_sections_to_file(const char * filename, const struct sample_hdr * hdr)
+{
+	if (sample_cores(hdr))
+		write_cores_to_file(filename, sample_cores(hdr));
+	if (sample_pmu(hdr))
+		write_pmu_to_file(filename, sample_pmu(hdr));
+	if (sample_timing_section(hdr))
+		write_timing_to_file(filename, sample_timing_section(hdr));
+}
+
+/* Create the CSV file of the L2 of a sample */
+static int csv_open(const char * filename, const struct csv_options * opts)
+{
+	int outfile = open(filename, O_CREAT | O_WRONLY | O_TRUNC | (opts->sync ? O_SYNC : 0),
+			   0666);
+
+	if (outfile < 0) {
+		perror("Failed to open outfile");
+		exit(EXIT_FAILURE);
+	}
+
+	return outfile;
+}
+
+/* Flush out leftover buffer data and close a CSV file */
+static void csv_close(int outfile, char * csv_file_buf, int bytes_to_write)
+{
+	if (bytes_to_write){
+		if (write(outfile, csv_file_buf, bytes_to_write) == -1) {
+			perror("Failed to write to outfile");
+		}
+	}
+
+	close(outfile);
+}
+
+/* Write a sample in the full format to filename, followed by the
+ * sections flagged in sections (SAMPLE_FLAG_CORES, _PMU, _TIMING) */
+static void write_full_to_csv(const char * filename, const void * sample,
+			      const struct cache_geometry * geom, uint32_t sections,
+			      const struct csv_options * opts)
+{
+	const struct cache_line * cache_contents = (const struct cache_line *)sample;
+	const char * sections_start;
+	char csv_file_buf[WRITE_SIZE + 10*CSV_LINE_SIZE];
+	int bytes_to_write = 0;
+	uint32_t cache_set_idx, cache_line_idx;
+	int outfile = csv_open(filename, opts);
+
+	for (cache_set_idx = 0; cache_set_idx < geom->sets; cache_set_idx++) {
+		for (cache_line_idx = 0; cache_line_idx < geom->ways; cache_line_idx++) {
+			bytes_to_write = csv_append(outfile, csv_file_buf, bytes_to_write,
+						    cache_contents->pid,
+						    cache_contents->addr,
+						    cache_contents->state, opts);
+			cache_contents++;
+		}   
+	}
+
+	csv_close(outfile, csv_file_buf, bytes_to_write);
+
+	/* The core and PMU sections follow the header after the
+	 * lines, and the timing section closes the sample */
+	sections_start = (const char *)cache_contents + sizeof(struct sample_hdr);
+	if (sections & SAMPLE_FLAG_CORES)
+		write_cores_to_file(filename, (const struct core_sample *)sections_start);
+	if (sections & SAMPLE_FLAG_PMU)
+		write_pmu_to_file(filename, (const struct pmu_sample *)
+				  (sections_start +
+				   ((sections & SAMPLE_FLAG_CORES) ? CORE_SECTION_SIZE : 0)));
+	if (sections & SAMPLE_FLAG_TIMING)
+		write_timing_to_file(filename, (const struct sample_timing *)
+				     (sections_start +
+				      ((sections & SAMPLE_FLAG_CORES) ? CORE_SECTION_SIZE : 0) +
+				      ((sections & SAMPLE_FLAG_PMU) ? PMU_SECTION_SIZE : 0)));
+}
+
+/* Write a variable-size record to filename. Deltas are applied on
+ * top of the state of the previous record, which is updated; the
+ * state is then expanded to the same layout produced by the full
+ * format. Summaries all go to occupancy.csv instead. Returns -1 on
+ * invalid records. */
+static int write_record_to_csv(const char * filename, struct sample_state * st,
+			       const struct sample_hdr * hdr, const struct csv_options * opts)
+{
+	char csv_file_buf[WRITE_SIZE + 10*CSV_LINE_SIZE];
+	int bytes_to_write = 0;
+	uint32_t cache_set_idx, cache_line_idx;
+	int outfile;
+
+	if (hdr->magic == SAMPLE_MAGIC_AGGREGATE) {
+		write_aggregate_to_file(filename, (const struct aggregate_sample *)hdr);
+		write_sections_to_file(filename, hdr);
+		return 0;
+	}
+
+	if (sample_state_update(st, hdr) < 0)
+		return -1;
+
+	if (sample_other(hdr, st->sets))
+		write_other_to_file(filename, hdr, sample_other(hdr, st->sets));
+	if (sample_kernel(hdr, st->sets))
+		write_kernel_to_file(filename, sample_kernel(hdr, st->sets));
+	write_sections_to_file(filename, hdr);
+
+	/* Unresolved addresses are stored divided by two in the full
+	 * format */
+	outfile = csv_open(filename, opts);
+	for (cache_set_idx = 0; cache_set_idx < st->sets; cache_set_idx++) {
+		for (cache_line_idx = 0; cache_line_idx < st->ways; cache_line_idx++) {
+			uint64_t line = sample_state_line(st, cache_set_idx, cache_line_idx);
+			pid_t pid = 0;
+			uint64_t addr = 0;
+			uint32_t state = 0;
+
+			if (line) {
+				pid = PACKED_LINE_PID(line);
+				state = PACKED_LINE_STATE(line);
+				addr = PACKED_LINE_ADDR(line);
+				if (!(st->flags & SAMPLE_FLAG_RESOLVED))
+					addr >>= 1;
+			}
+
+			bytes_to_write = csv_append(outfile, csv_file_buf,
+						    bytes_to_write, pid, addr, state, opts);
+		}
+	}
+
+	csv_close(outfile, csv_file_buf, bytes_to_write);
+	return 0;
+}
+
+#endif
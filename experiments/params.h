@@ -17,6 +17,8 @@
 // comma then 12 digit tag prepended with '0x' and ended with a newline
 #define CSV_LINE_SIZE 5 + 1 + (2 + 12) + 1
 #define WRITE_SIZE 35 * 1024 // 32 kb (8 4kb pages)
+/* L2 geometry of the TX2. The module reports the actual one through
+ * DUMPCACHE_CMD_GEOMETRY. */
 #define NUM_CACHESETS 2048
 #define CACHESIZE 1024*1024*2
 #define NUM_CACHELINES 16
@@ -37,6 +39,7 @@
 struct cache_line
 {
 	pid_t pid;
+	uint32_t state;		/* Coherence state bits of the tag */
 	uint64_t addr;
 };
 
@@ -48,6 +51,311 @@ struct cache_sample {
 	struct cache_set sets[NUM_CACHESETS];
 };
 
+/* Geometry of the L2, as described by CCSIDR_EL1 */
+struct cache_geometry
+{
+	uint32_t sets;
+	uint32_t ways;
+	uint32_t line_size;
+	uint32_t size;
+};
+
+/* State of the sample ring, as seen by the consumer. Offsets are
+ * the same used by the mmap interface. */
+struct ring_status
+{
+	uint64_t head;		/* Where the next sample will be stored */
+	uint64_t tail;		/* Oldest sample not consumed yet */
+	uint64_t len;		/* Size of the ring in bytes */
+	uint32_t pending;	/* Samples stored and not consumed yet */
+	uint32_t overruns;	/* Samples dropped because the ring was full */
+};
+
+/* Part of the L2 captured by each snapshot: the ways in way_mask of
+ * sets [first_set, last_set). A last_set or way_mask of 0 stands for
+ * all the sets or all the ways. */
+struct dump_selection
+{
+	uint32_t first_set;
+	uint32_t last_set;
+	uint32_t way_mask;
+};
+
+/* Counters read on each CPU with every snapshot */
+#define MAX_PMU_EVENTS       6
+#define PMU_EVENT_NONE       (~0U)
+
+/* ARMv8 PMU event numbers, PMU_EVENT_NONE for unused slots */
+struct pmu_events
+{
+	uint32_t events[MAX_PMU_EVENTS];
+};
+
+/* Snapshot every period occurrences of an ARMv8 PMU event on a CPU */
+struct pmu_trigger
+{
+	uint32_t cpu;
+	uint32_t event;
+	uint64_t period;
+};
+
+/* CPUs other than the one taking the snapshot that are stalled */
+#define STALL_POLICY_ALL     0	/* All the online ones */
+#define STALL_POLICY_CPUMASK 1	/* Those in cpus */
+#define STALL_POLICY_TARGETS 2	/* Those running threads of the targets,
+				 * or of the cgroup lines are filtered on */
+
+struct stall_policy
+{
+	uint32_t policy;
+	uint32_t reserved;
+	uint64_t cpus;		/* One bit per CPU */
+};
+
+/* Processes under observation */
+#define MAX_TARGETS          64
+
+struct dump_targets
+{
+	uint32_t count;
+	int32_t pids[MAX_TARGETS];
+};
+
+/* Lines that are resolved and stored individually */
+#define FILTER_NONE          0	/* All of them */
+#define FILTER_TARGETS       1	/* Those of the targets */
+#define FILTER_CGROUP        2	/* Those charged to a cgroup v2 or below */
+
+#define FILTER_PATH_MAX      256
+
+struct dump_filter
+{
+	uint32_t mode;
+	uint32_t reserved;
+	char cgroup[FILTER_PATH_MAX];	/* Relative to the cgroup v2 root */
+};
+
+/* Header preceding each variable-size record stored by the module.
+ * Full samples carry one too, right after their lines. */
+struct sample_hdr
+{
+	uint32_t magic;
+	uint32_t size;		/* Total size of the record, header included */
+	uint32_t entries;	/* Number of lines stored in the record */
+	uint32_t flags;
+	uint16_t first_set;	/* Selection the record was captured with */
+	uint16_t last_set;
+	uint16_t way_mask;
+	uint8_t stall_policy;	/* Policy the record was captured with */
+	uint8_t stalled;	/* Bitmask of the first 8 CPUs that were stalled */
+};
+
+/* Compact sample: only valid lines are stored, in set-major,
+ * way-minor order. Set and way of each line are implied by the
+ * per-set valid bitmaps, which come first. */
+struct packed_sample
+{
+	struct sample_hdr hdr;
+	uint16_t valid[];
+};
+
+/* Lines start at the first 8-byte boundary after the bitmaps */
+#define PACKED_LINES(sample, sets)					\
+	((uint64_t *)&(sample)->valid[((sets) + 3) & ~3])
+
+/* Delta sample: only the (set, way) pairs that changed since the
+ * previous sample. The new content of each changed pair, in packed
+ * form or 0 if the way became invalid, is followed by the positions
+ * (set * ways + way) of the pairs, one uint16_t each. */
+struct delta_sample
+{
+	struct sample_hdr hdr;
+	uint64_t lines[];
+};
+
+#define DELTA_POSITIONS(sample)					\
+	((uint16_t *)&(sample)->lines[(sample)->hdr.entries])
+
+/* Occupancy summary, stored instead of the lines in aggregate mode.
+ * The number of valid lines of each selected set, one byte each, is
+ * followed by the number of valid lines of each page color of the
+ * L2, and then by one entry per owner. Owners are the pids the lines
+ * resolved to or, with SAMPLE_FLAG_CGROUPS, the ids (inode numbers)
+ * of the cgroups v2 of those processes; 0 stands for no owner. */
+struct aggregate_sample
+{
+	struct sample_hdr hdr;	/* entries is the number of owners */
+	uint32_t valid;		/* Valid lines in the selection */
+	uint32_t filtered;	/* Of which ruled out by the filter */
+	uint16_t sets;		/* Selected sets */
+	uint16_t colors;	/* Page colors of the L2 */
+	uint32_t reserved;
+	uint8_t set_valid[];
+};
+
+struct aggregate_owner
+{
+	uint32_t id;
+	uint32_t lines;
+};
+
+#define AGGREGATE_COLORS(sample)					\
+	((uint32_t *)&(sample)->set_valid[((sample)->sets + 7) & ~7])
+#define AGGREGATE_OWNERS(sample)					\
+	((struct aggregate_owner *)&AGGREGATE_COLORS(sample)[((sample)->colors + 1) & ~1])
+
+/* Owner of the lines in excess of the 256 owners a summary holds */
+#define AGGREGATE_ID_OTHER   (~0U)
+
+#define SAMPLE_MAGIC_PACKED  0x4b434150 /* "PACK" */
+#define SAMPLE_MAGIC_DELTA   0x544c4544 /* "DELT" */
+#define SAMPLE_MAGIC_PAD     0x20444150 /* "PAD " - skip to next aperture */
+#define SAMPLE_MAGIC_AGGREGATE 0x52474741 /* "AGGR" */
+#define SAMPLE_MAGIC_FULL    0x4c4c5546 /* "FULL" - header of a full sample */
+
+/* Set in the header if lines carry pid and virtual address */
+#define SAMPLE_FLAG_RESOLVED (1 << 0)
+/* Set in the header if the record ends with a core section */
+#define SAMPLE_FLAG_CORES    (1 << 1)
+/* Set in the header if the record ends with a timing section */
+#define SAMPLE_FLAG_TIMING   (1 << 2)
+/* Set in the header if the record carries a PMU section */
+#define SAMPLE_FLAG_PMU      (1 << 3)
+/* Set in the header if the lines are followed by an other section,
+ * with the number of filtered lines of each selected set */
+#define SAMPLE_FLAG_OTHER    (1 << 4)
+/* Set in the header if the owners of a summary are cgroups */
+#define SAMPLE_FLAG_CGROUPS  (1 << 5)
+/* Set in the header if the lines are followed by a kernel section,
+ * after the other section if there is one */
+#define SAMPLE_FLAG_KERNEL   (1 << 6)
+
+/* Packed line: | 63..22 line address >> 6 | 21..20 state | 19..0 pid |
+ * The address holds 48-bit virtual addresses. Pids are below
+ * PACKED_PID_LIMIT, which the module checks against pid_max. */
+#define PACKED_PID_BITS      20
+#define PACKED_PID_MASK      ((1UL << PACKED_PID_BITS) - 1)
+#define PACKED_PID_LIMIT     ((pid_t)(PACKED_PID_MASK - 0x10))
+#define PACKED_STATE_SHIFT   20
+#define PACKED_STATE_MASK    (0x3UL << PACKED_STATE_SHIFT)
+#define PACKED_ADDR_SHIFT    22
+#define PACKED_LINE_PID(line)			\
+	((pid_t)((line) & PACKED_PID_MASK))
+#define PACKED_LINE_STATE(line)			\
+	((uint32_t)(((line) & PACKED_STATE_MASK) >> PACKED_STATE_SHIFT))
+#define PACKED_LINE_ADDR(line)			\
+	(((line) >> PACKED_ADDR_SHIFT) << 6)
+
+/* Pid of the lines ruled out by the filter in the full format. Their
+ * address is left physical. */
+#define FILTERED_PID         ((pid_t)PACKED_PID_MASK)
+
+/* With classification enabled, the lines of pages that no process
+ * maps are reported with the pid of the kind of page they belong
+ * to. Their address is left physical. */
+#define PAGE_CLASS_PAGECACHE 1	/* Page cache */
+#define PAGE_CLASS_SLAB      2	/* Slab objects */
+#define PAGE_CLASS_KERNEL    3	/* Kernel text and data */
+#define PAGE_CLASS_PGTABLE   4	/* Page tables */
+#define PAGE_CLASS_FREE      5	/* Free pages */
+#define PAGE_CLASS_OTHER     6	/* Any other kernel page */
+
+#define PAGE_CLASS_PID_BASE  PACKED_PID_LIMIT
+#define PAGE_CLASS_PID(class) (PAGE_CLASS_PID_BASE + (class))
+#define PAGE_CLASS_OF(pid)						\
+	((pid) > PAGE_CLASS_PID_BASE && (pid) < FILTERED_PID ? (pid) - PAGE_CLASS_PID_BASE : 0)
+
+/* Page cache and slab pages holding lines of a record, as listed in
+ * its kernel section */
+#define KERNEL_NAME_LEN      16
+
+struct kernel_page
+{
+	uint64_t pfn;
+	uint32_t class;
+	uint32_t lines;		/* Lines of the page in the selection */
+	uint64_t ino;		/* Page cache: inode of the file */
+	uint64_t index;		/* Page cache: offset in the file, in pages */
+	char name[KERNEL_NAME_LEN];	/* Slab: name of the cache */
+};
+
+/* Lines of the pages beyond the first 256 are counted as dropped */
+struct kernel_section
+{
+	uint32_t count;
+	uint32_t dropped;
+	struct kernel_page pages[];
+};
+
+/* Private arrays of an A57 core */
+#define L1D_SETS             256
+#define L1D_WAYS             2
+#define L1I_SETS             256
+#define L1I_WAYS             3
+#define L1D_TLB_ENTRIES      32
+#define L2_TLB_SETS          256
+#define L2_TLB_WAYS          4
+
+/* At most this many cores share the L2 */
+#define MAX_CLUSTER_CPUS     4
+
+/* Raw content of the private arrays of one core, as returned by the
+ * DL1DATAn_EL1 registers. Tags are stored as DATA1:DATA0, TLB
+ * entries as DATA1:DATA0 followed by DATA3:DATA2. */
+struct core_sample
+{
+	uint32_t cpu;		/* CPU the arrays belong to, ~0 if unused */
+	uint32_t reserved;
+	uint64_t l1d_tags[L1D_SETS * L1D_WAYS];
+	uint64_t l1i_tags[L1I_SETS * L1I_WAYS];
+	uint64_t l1d_tlb[L1D_TLB_ENTRIES * 2];
+	uint64_t l2_tlb[L2_TLB_SETS * L2_TLB_WAYS * 2];
+};
+
+/* The core section is appended to samples in any format: at the end
+ * of records, or after the lines in the full format */
+#define CORE_SECTION_SIZE (MAX_CLUSTER_CPUS * sizeof(struct core_sample))
+
+/* Pid reported for the lines whose owner could not be found */
+#define RMAP_FAILED_PID      99999
+
+/* Per-CPU entries of the timing section */
+#define MAX_STALL_CPUS       8
+
+/* Timing of a snapshot. Timestamps and durations are in ticks of the
+ * architected timer, which runs at freq Hz. The start and end are also
+ * given as CLOCK_MONOTONIC, to line samples up with user space. */
+struct sample_timing
+{
+	uint64_t start;		/* Before the other CPUs are interrupted */
+	uint64_t end;		/* Once the sample is complete */
+	uint64_t start_ns;	/* Start, as CLOCK_MONOTONIC in ns */
+	uint64_t end_ns;	/* End, as CLOCK_MONOTONIC in ns */
+	uint32_t freq;
+	uint32_t cpu;		/* CPU that took the snapshot */
+	uint32_t stall[MAX_STALL_CPUS];	/* From start to each CPU stalling, ~0 if not */
+	uint32_t dump;		/* Reading the tags, inline resolution included */
+	uint32_t resolve;	/* Deferred resolution, 0 if not deferred */
+	uint32_t valid;		/* Valid lines in the selection */
+	uint32_t rmap_failures;	/* Valid lines resolved to RMAP_FAILED_PID */
+};
+
+/* The timing section closes samples in any format, after the core
+ * and PMU sections if there are any */
+#define TIMING_SECTION_SIZE (sizeof(struct sample_timing))
+
+/* Running totals of the PMU counters of each CPU, read by the CPU
+ * itself as it enters the stall. Totals of CPUs whose counters could
+ * not be read are ~0. */
+struct pmu_sample
+{
+	uint32_t events[MAX_PMU_EVENTS];
+	uint64_t counts[MAX_STALL_CPUS][MAX_PMU_EVENTS];
+};
+
+/* The PMU section sits between the core and timing sections */
+#define PMU_SECTION_SIZE (sizeof(struct pmu_sample))
+
 #define NUM_ITERATIONS 3
 #define BASE_BUFFSIZE_MB 2.0
 
@@ -57,6 +365,30 @@ struct cache_sample {
 #define DUMPCACHE_CMD_CONFIG _IOW(0, 0, unsigned long)
 /* Command to initiate a cache dump */
 #define DUMPCACHE_CMD_SNAPSHOT _IOW(0, 1, unsigned long)
+/* Command to set the number of samples between keyframes in delta mode */
+#define DUMPCACHE_CMD_KEYFRAME _IOW(0, 2, unsigned long)
+/* Command to retrieve the geometry of the L2 */
+#define DUMPCACHE_CMD_GEOMETRY _IOR(0, 3, struct cache_geometry)
+/* Command to retrieve the state of the sample ring */
+#define DUMPCACHE_CMD_RING_STATUS _IOR(0, 4, struct ring_status)
+/* Command to release the oldest samples in the ring */
+#define DUMPCACHE_CMD_RING_CONSUME _IOW(0, 5, unsigned long)
+/* Command to start in-kernel periodic sampling with the given
+ * period in ns, or to stop it if the period is 0 */
+#define DUMPCACHE_CMD_PERIODIC _IOW(0, 6, unsigned long)
+/* Command to restrict snapshots to part of the L2 */
+#define DUMPCACHE_CMD_SELECT _IOW(0, 7, struct dump_selection)
+/* Command to choose the PMU events counted along with snapshots */
+#define DUMPCACHE_CMD_PMU_EVENTS _IOW(0, 8, struct pmu_events)
+/* Command to start taking snapshots every time a PMU counter
+ * overflows, or to stop if the period is 0 */
+#define DUMPCACHE_CMD_TRIGGER _IOW(0, 9, struct pmu_trigger)
+/* Command to choose which CPUs are stalled during snapshots */
+#define DUMPCACHE_CMD_STALL _IOW(0, 10, struct stall_policy)
+/* Command to set the processes under observation */
+#define DUMPCACHE_CMD_TARGETS _IOW(0, 11, struct dump_targets)
+/* Command to only resolve and store the lines of some processes */
+#define DUMPCACHE_CMD_FILTER _IOW(0, 12, struct dump_filter)
 
 #define DUMPCACHE_CMD_VALUE_WIDTH  16 
 #define DUMPCACHE_CMD_VALUE_MASK   ((1 << DUMPCACHE_CMD_VALUE_WIDTH) - 1)
@@ -80,3 +412,46 @@ struct cache_sample {
 /* Command to enable/disable snapshot timestamping */
 #define DUMPCACHE_CMD_TIMESTAMP_EN_SHIFT       (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 7))
 #define DUMPCACHE_CMD_TIMESTAMP_DIS_SHIFT      (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 8))
+
+/* Command to enable/disable the packed sample format */
+#define DUMPCACHE_CMD_PACKED_EN_SHIFT        (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 9))
+#define DUMPCACHE_CMD_PACKED_DIS_SHIFT       (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 10))
+
+/* Command to enable/disable delta encoding between samples */
+#define DUMPCACHE_CMD_DELTA_EN_SHIFT         (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 11))
+#define DUMPCACHE_CMD_DELTA_DIS_SHIFT        (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 12))
+
+/* Command to enable/disable tag extraction on all the CPUs sharing
+ * the L2 */
+#define DUMPCACHE_CMD_PARALLEL_EN_SHIFT      (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 13))
+#define DUMPCACHE_CMD_PARALLEL_DIS_SHIFT     (1 << (DUMPCACHE_CMD_VALUE_WIDTH + 14))
+
+/* Command to enable/disable deferring address resolution until the
+ * other CPUs have been released */
+#define DUMPCACHE_CMD_DEFER_EN_SHIFT         (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 15))
+#define DUMPCACHE_CMD_DEFER_DIS_SHIFT        (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 16))
+
+/* Command to enable/disable the capture of the L1 and TLBs of the
+ * cores sharing the L2 */
+#define DUMPCACHE_CMD_CORES_EN_SHIFT         (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 17))
+#define DUMPCACHE_CMD_CORES_DIS_SHIFT        (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 18))
+
+/* Command to enable/disable reading the PMU counters of every CPU
+ * with each snapshot */
+#define DUMPCACHE_CMD_PMU_EN_SHIFT           (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 19))
+#define DUMPCACHE_CMD_PMU_DIS_SHIFT          (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 20))
+
+/* Command to enable/disable storing occupancy summaries instead of
+ * the lines */
+#define DUMPCACHE_CMD_AGGREGATE_EN_SHIFT     (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 21))
+#define DUMPCACHE_CMD_AGGREGATE_DIS_SHIFT    (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 22))
+
+/* Command to enable/disable counting lines per cgroup rather than per
+ * process in summaries */
+#define DUMPCACHE_CMD_AGG_CGROUPS_EN_SHIFT   (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 23))
+#define DUMPCACHE_CMD_AGG_CGROUPS_DIS_SHIFT  (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 24))
+
+/* Command to enable/disable classifying the lines of pages that no
+ * process maps */
+#define DUMPCACHE_CMD_CLASSIFY_EN_SHIFT      (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 25))
+#define DUMPCACHE_CMD_CLASSIFY_DIS_SHIFT     (1UL << (DUMPCACHE_CMD_VALUE_WIDTH + 26))
@@ -0,0 +1,104 @@
+#!/usr/bin/python
+
+#######################################################
+#                                                     #
+# Report coherence state transitions of L2 lines      #
+# across consecutive cache snapshots acquired with    #
+# the -M option of snapshot                           #
+#                                                     #
+#######################################################
+
+import os
+import sys
+import operator
+
+# Decoding of the two state bits of the L2 tag RAM
+STATES = ["I", "S", "E", "M"]
+
+# Geometry of the L2, saved next to the dumps by snapshot and
+# capture2csv: the number of sets, then of ways
+def parse_geometry(dump_file):
+    path = os.path.join(os.path.dirname(dump_file), "geometry.txt")
+    try:
+        file = open(path)
+    except IOError:
+        print "Error: %s not found. It is saved along with the dumps." % (path)
+        sys.exit(1)
+
+    (sets, ways) = [int(v) for v in file.read().split()[:2]]
+    file.close()
+    return (sets, ways)
+
+def parse_dump(dump_file):
+    lines = []
+    
+    file = open(dump_file)
+    for l in file:
+        fields = l.strip('\n').split(",")
+        if len(fields) != 3:
+            print "Error: no state column in %s. Use snapshot -M." % (dump_file)
+            sys.exit(1)
+
+        lines.append((int(fields[0]), int(fields[1], 0), int(fields[2])))
+
+    file.close()
+    return lines
+
+class Transitions:
+    def __init__(self, ways):
+        # Lines are dumped in set-major, way-minor order
+        self.ways = ways
+        # (from, to) -> count
+        self.counts = {}
+        # (set, line address) -> (pids, transitions) between M and S
+        self.hot = {}
+
+    # Compare two snapshots position by position. Only the lines that
+    # are still held by the same (set, way) are considered.
+    def add(self, prev, cur):
+        for i in range(0, min(len(prev), len(cur))):
+            (ppid, paddr, pstate) = prev[i]
+            (cpid, caddr, cstate) = cur[i]
+
+            if pstate == 0 or cstate == 0 or paddr != caddr or pstate == cstate:
+                continue
+
+            key = (STATES[pstate], STATES[cstate])
+            self.counts[key] = self.counts.get(key, 0) + 1
+
+            # Lines bouncing between a dirty and a shared state
+            # are candidates for (false) sharing
+            if "E" not in key:
+                line = (i / self.ways, caddr)
+                (pids, count) = self.hot.get(line, (set(), 0))
+                pids.add(ppid)
+                pids.add(cpid)
+                self.hot[line] = (pids, count + 1)
+
+    def report(self, top):
+        print "=== TRANSITIONS ==="
+        for (key, count) in sorted(self.counts.items(), key=operator.itemgetter(1), reverse=True):
+            print "%s -> %s: %i" % (key[0], key[1], count)
+
+        print "=== MOST SHARED LINES ==="
+        hot = sorted(self.hot.items(), key=lambda x: x[1][1], reverse=True)
+        for ((index, addr), (pids, count)) in hot[:top]:
+            print "0x%012x (set %i): %i transitions, pids %s" % \
+                (addr, index, count, ",".join([str(p) for p in sorted(pids)]))
+
+if __name__ == '__main__':
+
+    if len(sys.argv) < 3:
+        print(sys.argv[0] + " cachedump0.csv cachedump1.csv [...]")
+        sys.exit(1)
+
+    (sets, ways) = parse_geometry(sys.argv[1])
+    trans = Transitions(ways)
+    prev = parse_dump(sys.argv[1])
+    
+    for f in sys.argv[2:]:
+        cur = parse_dump(f)
+        trans.add(prev, cur)
+        prev = cur
+
+    trans.report(20)
@@ -18,6 +18,12 @@ import operator
 
 PAGE_SIZE = 0x1000
 
+# Pid of the lines left unresolved by an in-kernel filter
+FILTERED_PID = 0xfffff
+
+# Pids of the lines of kernel pages, when classified in the kernel
+PAGE_CLASS_PIDS = range(0xffff0, 0xffff6)
+
 class Accesses:
     def __init__(self, pid):
         self.pid = pid
@@ -128,8 +134,9 @@ class CacheDump:
         lines = [l.strip('\n') for l in file.readlines()]
         for l in lines:
             fields = l.split(",")
-            if len(fields) == 2:
-                (pid, page) = fields
+            # A third field with the coherence state is optional
+            if len(fields) in (2, 3):
+                (pid, page) = fields[0:2]
                 pid = int(pid)
 
                 # Make sure we have an entry for each new PID we
@@ -140,7 +147,8 @@ class CacheDump:
                 if pid in self.pids_from_file:
                     self.pid_accesses[pid].add_access(page)
                     self.okay_entries += 1
-                elif pid >= 0:
+                elif pid >= 0 and pid != FILTERED_PID and \
+                     pid not in PAGE_CLASS_PIDS:
                     self.pid_accesses[pid].add_access(page)
                     self.okay_entries += 1
                     self.not_in_pidfile += 1
@@ -0,0 +1,28 @@
+#!/bin/bash
+
+# Script to check that captures survive wrapping around the sample
+# ring with the core, timing and PMU sections enabled. The sections
+# make the sample size, and so the length of the ring, a non-multiple
+# of the page size. The ring holds about 6000 full samples, so the
+# kernel-timed runs below wrap around it at least twice.
+
+bm="sleep 40"
+period_us=2000
+out=/tmp/ring_wrap
+
+for mode in "" "-c" "-d 16"
+do
+    echo "Sections, streaming, format: ${mode:-full}"
+    sudo rm -rf $out $out-csv
+    if ! sudo ./snapshot "$bm" -o $out -f -s -b -L -T -P -k $period_us $mode 1>/dev/null; then
+	echo "FAILED: snapshot exited with an error"
+	continue
+    fi
+
+    sudo ./capture2csv $out/capture.bin $out-csv 1>/dev/null || echo "FAILED: capture2csv"
+
+    samples=$(sudo ls $out-csv | grep -c "^cachedump[0-9]*\.csv$")
+    rows=$(sudo tail -n +2 $out-csv/timing.csv | wc -l)
+    echo "$samples samples, $rows timing rows"
+    [ "$samples" -eq "$rows" ] || echo "FAILED: samples and timing rows differ"
+done
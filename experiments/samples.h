@@ -0,0 +1,215 @@
+/*************************************************************/
+/*                                                           */
+/*  Helpers to decode the variable-size records stored by    */
+/*  the module in packed and delta mode. Include after       */
+/*  params.h.                                                */
+/*                                                           */
+/*************************************************************/
+
+#ifndef __SAMPLES_H__
+#define __SAMPLES_H__
+
+/* Expanded content of one snapshot: the packed line held by each
+ * (set, way), or 0 if the way is invalid. Lines are stored in
+ * set-major, way-minor order. */
+struct sample_state {
+	uint32_t flags;
+	uint32_t sets;
+	uint32_t ways;
+	uint64_t * lines;
+};
+
+/* Size the state for the geometry reported by the module. Returns -1
+ * if the allocation fails. */
+static inline int sample_state_init(struct sample_state * st,
+				    const struct cache_geometry * geom)
+{
+	st->flags = 0;
+	st->sets = geom->sets;
+	st->ways = geom->ways;
+	st->lines = (uint64_t *)calloc(geom->sets * geom->ways, sizeof(uint64_t));
+
+	return st->lines ? 0 : -1;
+}
+
+static inline void sample_state_free(struct sample_state * st)
+{
+	free(st->lines);
+	st->lines = NULL;
+}
+
+static inline uint64_t sample_state_line(const struct sample_state * st,
+					 uint32_t set, uint32_t way)
+{
+	return st->lines[set * st->ways + way];
+}
+
+static inline int sample_is_valid(const struct sample_hdr * hdr)
+{
+	return hdr->magic == SAMPLE_MAGIC_PACKED || hdr->magic == SAMPLE_MAGIC_DELTA;
+}
+
+/* Only packed samples can be decoded without the previous ones */
+static inline int sample_is_keyframe(const struct sample_hdr * hdr)
+{
+	return hdr->magic == SAMPLE_MAGIC_PACKED;
+}
+
+/* Replace the state with the content of a keyframe */
+static inline void sample_state_load(struct sample_state * st,
+				     const struct packed_sample * sample)
+{
+	const uint64_t * lines = PACKED_LINES(sample, st->sets);
+	uint32_t set, way, entry = 0;
+	uint64_t * dst = st->lines;
+
+	for (set = 0; set < st->sets; set++) {
+		for (way = 0; way < st->ways; way++) {
+			if (sample->valid[set] & (1 << way))
+				*dst++ = lines[entry++];
+			else
+				*dst++ = 0;
+		}
+	}
+
+	st->flags = sample->hdr.flags;
+}
+
+/* Turn the state of the previous sample into the one of the delta */
+static inline void sample_state_apply(struct sample_state * st,
+				      const struct delta_sample * sample)
+{
+	const uint16_t * pos = DELTA_POSITIONS(sample);
+	uint32_t i;
+
+	for (i = 0; i < sample->hdr.entries; i++)
+		st->lines[pos[i]] = sample->lines[i];
+
+	st->flags = sample->hdr.flags;
+}
+
+/* Advance the state by one record. Returns -1 on invalid records. */
+static inline int sample_state_update(struct sample_state * st,
+				      const struct sample_hdr * hdr)
+{
+	if (hdr->magic == SAMPLE_MAGIC_PACKED)
+		sample_state_load(st, (const struct packed_sample *)hdr);
+	else if (hdr->magic == SAMPLE_MAGIC_DELTA)
+		sample_state_apply(st, (const struct delta_sample *)hdr);
+	else
+		return -1;
+
+	return 0;
+}
+
+/* First 8-byte boundary after the lines of a record, where the
+ * optional sections start */
+static inline const char * sample_lines_end(const struct sample_hdr * hdr, uint32_t sets)
+{
+	const char * end;
+
+	if (hdr->magic == SAMPLE_MAGIC_PACKED)
+		end = (const char *)(PACKED_LINES((const struct packed_sample *)hdr, sets) +
+				     hdr->entries);
+	else
+		end = (const char *)(DELTA_POSITIONS((const struct delta_sample *)hdr) +
+				     hdr->entries);
+
+	return (const char *)hdr + (((end - (const char *)hdr) + 7) & ~7);
+}
+
+/* Number of filtered lines of each set in the selection of a record,
+ * or NULL if it was not filtered */
+static inline const uint8_t * sample_other(const struct sample_hdr * hdr, uint32_t sets)
+{
+	if (!(hdr->flags & SAMPLE_FLAG_OTHER))
+		return NULL;
+
+	return (const uint8_t *)sample_lines_end(hdr, sets);
+}
+
+/* Kernel section of a record, or NULL if lines were not classified.
+ * It follows the other section, one byte per selected set padded to
+ * 8 bytes. */
+static inline const struct kernel_section * sample_kernel(const struct sample_hdr * hdr,
+							  uint32_t sets)
+{
+	const char * start;
+
+	if (!(hdr->flags & SAMPLE_FLAG_KERNEL))
+		return NULL;
+
+	start = sample_lines_end(hdr, sets);
+	if (hdr->flags & SAMPLE_FLAG_OTHER)
+		start += (hdr->last_set - hdr->first_set + 7) & ~7;
+
+	return (const struct kernel_section *)start;
+}
+
+/* Timing section at the end of a record, or NULL if there is none */
+static inline const struct sample_timing * sample_timing_section(const struct sample_hdr * hdr)
+{
+	if (!(hdr->flags & SAMPLE_FLAG_TIMING))
+		return NULL;
+
+	return (const struct sample_timing *)
+		((const char *)hdr + hdr->size - TIMING_SECTION_SIZE);
+}
+
+/* PMU section of a record, or NULL if there is none. It precedes
+ * the timing section. */
+static inline const struct pmu_sample * sample_pmu(const struct sample_hdr * hdr)
+{
+	size_t end = hdr->size;
+
+	if (!(hdr->flags & SAMPLE_FLAG_PMU))
+		return NULL;
+
+	if (hdr->flags & SAMPLE_FLAG_TIMING)
+		end -= TIMING_SECTION_SIZE;
+
+	return (const struct pmu_sample *)
+		((const char *)hdr + end - PMU_SECTION_SIZE);
+}
+
+/* Core section of a record, or NULL if there is none. It precedes
+ * the PMU and timing sections. */
+static inline const struct core_sample * sample_cores(const struct sample_hdr * hdr)
+{
+	size_t end = hdr->size;
+
+	if (!(hdr->flags & SAMPLE_FLAG_CORES))
+		return NULL;
+
+	if (hdr->flags & SAMPLE_FLAG_TIMING)
+		end -= TIMING_SECTION_SIZE;
+	if (hdr->flags & SAMPLE_FLAG_PMU)
+		end -= PMU_SECTION_SIZE;
+
+	return (const struct core_sample *)
+		((const char *)hdr + end - CORE_SECTION_SIZE);
+}
+
+/* Rebuild the index-th snapshot out of a table of consecutive
+ * records, starting from the closest keyframe that precedes it.
+ * Returns -1 if no such keyframe exists. */
+static inline int sample_state_rebuild(struct sample_state * st,
+				       struct sample_hdr ** records, int index)
+{
+	int first = index;
+
+	while (first >= 0 && !sample_is_keyframe(records[first]))
+		--first;
+
+	if (first < 0)
+		return -1;
+
+	for (; first <= index; ++first) {
+		if (sample_state_update(st, records[first]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+#endif
@@ -12,6 +12,9 @@
 
 #define _GNU_SOURCE
 #include "params.h"
+#include "samples.h"
+#include "csv.h"
+#include "capture.h"
 #include <limits.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -19,13 +22,34 @@
 #include <sched.h>
 #include <sys/sysinfo.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <dirent.h>
 
 #define MAX_BENCHMARKS 20
+#define MAX_OBSERVED 256
+#define MAX_ATTACH 16
+#define COMM_LEN 16
+#define REDISCOVER_MS 1000
+#define CGROUP_ROOT "/sys/fs/cgroup"
 #define PARENT_CPU 2
 #define SNAP_PERIOD_MS 5
-
-#define USAGE_STR "Usage: %s [-rmafi] [-o outpath] [-p period_ms] "	\
-	"\"benchmark 1\", ..., \"benchmark n\"\n"			\
+#define WRITER_SLOTS 4
+#define MAX_EVENTS 4
+#define FREEZER_POLL_MS 100
+#define FREEZER_POLL_US 10
+
+#define USAGE_STR "Usage: %s [-rmaficjesbLMTPK] [-o outpath] [-p period_ms] [-d keyframe_period] " \
+	"[-k period_us] [-g event:count:cpu] [-R first_set:last_set] [-W way_mask] [-E events] " \
+	"[-S stall_policy] [-F filter] [-A pid|cgroup] [-Q slots] [-Z cgroup_dir] " \
+	"[-X pid:pid,...|cgroup:path|comm:name] [\"benchmark 1\", ..., \"benchmark n\"]\n" \
 	"Options:\n"							\
 	"-r\tSet real-time priorities. Parent has highest priority,\n"	\
 	"  \tthe priority of the benchmarks is set in decreasing order.\n" \
@@ -45,11 +69,89 @@
 	"-t\tOperate in transparent mode, i.e. defer acquisition of samples to disk to the end.\n\n" \
 	"-l\tDo not acquire the memory layout of the observed benchmarks.\n\n" \
         "-h\tOperate in overhead measurement mode. Only 2 back-to-back snapshots will be acquired.\n" \
+	"\n" \
+	"-c\tCompact mode. Ask the module to only store valid lines in packed format.\n" \
+	"\n" \
+	"-d\tDelta mode. Only store lines that changed since the previous snapshot,\n" \
+	"  \twith a full keyframe every keyframe_period snapshots (0 = module default).\n" \
+	"\n" \
+	"-j\tParallel mode. Split the tag extraction across all the CPUs sharing the L2.\n" \
+	"\n" \
+	"-e\tDeferred resolution. Only capture raw tags while the other CPUs are stalled,\n" \
+	"  \tand perform physical->virtual address translation after releasing them.\n" \
+	"\n" \
+	"-s\tStreaming mode. Implies -t, but save samples to disk as soon as they are\n" \
+	"  \tacquired, so that the length of the capture is not bounded by the buffers.\n" \
+	"\n" \
+	"-k\tKernel-timed mode. Implies -t. Let the module take snapshots every period_us\n" \
+	"  \tusec on its own. Benchmarks are not stopped and layout files are not acquired.\n" \
+	"\n" \
+	"-g\tEvent-triggered mode. Same as -k, but let the module take a snapshot every\n" \
+	"  \tcount occurrences of an ARMv8 PMU event (e.g. 0x17:100000:0 for every\n" \
+	"  \t100000 L2 refills on CPU 0). Only events in user space are counted.\n" \
+	"\n" \
+	"-R\tOnly capture sets first_set to last_set - 1.\n" \
+	"\n" \
+	"-W\tOnly capture the ways in way_mask (e.g. 0xff00) of each set.\n" \
+	"\n" \
+	"-b\tBinary mode. Save the samples as stored by the module, along with a\n" \
+	"  \tdescription of the run, in a single " CAPTURE_FILENAME " file instead of\n" \
+	"  \tCSV files. Convert it with capture2csv. Best combined with -c or -d.\n" \
+	"\n" \
+	"-L\tAlso capture the L1 tags and TLBs of the cores sharing the L2. Raw entries\n" \
+	"  \tare saved in cachedump<n>-cores.csv.\n" \
+	"\n" \
+	"-M\tAdd the coherence state bits of each line as a third CSV column.\n" \
+	"\n" \
+	"-T\tTimestamp snapshots. Capture times, stall latency of each CPU, valid lines\n" \
+	"  \tand resolution failures are appended to timing.csv, one row per snapshot.\n" \
+	"\n" \
+	"-P\tRead the PMU counters of every CPU with each snapshot. Running totals are\n" \
+	"  \tappended to pmu.csv, one row per snapshot, CPU and event.\n" \
+	"\n" \
+	"-E\tImplies -P. Count the comma-separated ARMv8 events (e.g. 0x17,0x18)\n" \
+	"  \tinstead of L2 refills/write-backs, L1D refills, instructions and cycles.\n" \
+	"\n" \
+	"-S\tOnly stall some of the other CPUs during snapshots: \"targets\" for those\n" \
+	"  \trunning the benchmarks, and the processes of the -F cgroup if any, or a\n" \
+	"  \tmask of CPUs (e.g. 0x3c). Default is \"all\".\n" \
+	"  \tLines are then resolved after the snapshot, as with -e.\n" \
+	"\n" \
+	"-F\tOnly resolve the lines of \"targets\", i.e. the benchmarks, or of the pages\n" \
+	"  \tcharged to a cgroup v2 path (e.g. /bench). With -c or -d, the other lines\n" \
+	"  \tare only counted per set in cachedump<n>-other.csv.\n" \
+	"\n" \
+	"-K\tClassify the lines of pages no process maps: page cache, slab, kernel\n" \
+	"  \timage, page tables, free or other kernel pages, reported with pids\n" \
+	"  \t0xffff0 to 0xffff5. With -c or -d, page cache and slab pages are listed\n" \
+	"  \twith their inode and offset or slab cache in cachedump<n>-kernel.csv.\n" \
+	"\n" \
+	"-A\tAggregate mode. Instead of the lines, only store the valid lines of each set\n" \
+	"  \tand page color and the lines of each \"pid\" or \"cgroup\". Summaries are\n" \
+	"  \tappended to occupancy.csv, one group of rows per snapshot.\n" \
+	"\n" \
+	"-Q\tNumber of snapshots that can wait to be saved by the writer thread while\n" \
+	"  \tthe benchmarks run. Default is " STR(WRITER_SLOTS) ". With 0, snapshots are saved before\n" \
+	"  \tresuming the benchmarks.\n" \
+	"\n" \
+	"-Z\tRun the benchmarks in a new cgroup created at cgroup_dir, and freeze it\n" \
+	"  \tinstead of sending SIGSTOP/SIGCONT, so that threads and forked processes\n" \
+	"  \tstop too. Either a cgroup v2 directory (Linux 5.2 or later) or one of a\n" \
+	"  \tv1 freezer hierarchy, e.g. /sys/fs/cgroup/freezer/shutter. Attached\n" \
+	"  \tprocesses are moved into it, and back to their own cgroup when done: to\n" \
+	"  \tfreeze a cgroup attached with -X in place, pass its own directory.\n" \
+	"\n" \
+	"-X\tAttach to running processes, given by PID, as the processes of a cgroup v2\n" \
+	"  \tpath (e.g. /system.slice/nginx.service) or by name as in /proc/pid/comm.\n" \
+	"  \tCan be repeated. Cgroups and names are looked up again every\n" \
+	"  \t" STR(REDISCOVER_MS) " msec for new processes. Without benchmarks, run until\n" \
+	"  \tinterrupted or until no attached process is left.\n" \
 	"\n"
 
 #define MS_TO_NS(ms) \
 	(ms * 1000 * 1000)
 #define MALLOC_CMD_PAD (32)
+#define BUF_SIZE (1024)
 
 
 int flag_rt = 0;
@@ -63,6 +165,43 @@ int flag_transparent = 0;
 int flag_bm_layout = 1;
 int flag_overhead = 0;
 int flag_periodic = 1;
+int flag_packed = 0;
+int flag_delta = 0;
+int flag_parallel = 0;
+int flag_defer = 0;
+int flag_stream = 0;
+int flag_kernel_timer = 0;
+int flag_kernel_trigger = 0;
+int flag_cores = 0;
+int flag_state = 0;
+int flag_timing = 0;
+int flag_pmu = 0;
+int flag_aggregate = 0;
+int flag_agg_cgroups = 0;
+int flag_classify = 0;
+int flag_binary = 0;
+
+/* PMU events to count, module defaults unless set with -E */
+struct pmu_events pmu_events;
+int pmu_events_set = 0;
+
+/* Period of in-kernel sampling in usec */
+long int kernel_period_us = 0;
+
+/* CPUs stalled during snapshots, all of them by default */
+struct stall_policy stall_policy = { STALL_POLICY_ALL, 0, 0 };
+
+/* Lines resolved individually, all of them by default */
+struct dump_filter filter = { FILTER_NONE, 0, "" };
+
+/* Counter that triggers in-kernel sampling */
+struct pmu_trigger kernel_trigger = { 0, 0, 0 };
+
+/* Part of the L2 to capture, everything by default */
+struct dump_selection selection = { 0, 0, 0 };
+
+/* Snapshots between keyframes in delta mode, 0 = module default */
+long int keyframe_period = 0;
 
 /* Default sampling period is 5 ms */
 long int snap_period_ms = SNAP_PERIOD_MS;
@@ -72,13 +211,120 @@ char * outdir = SCRATCHSPACE_DIR;
 int bm_count = 0;
 int running_bms;
 char * bms [MAX_BENCHMARKS];
-pid_t pids [MAX_BENCHMARKS];
+
+/* Processes observed during the run: the benchmarks first, then the
+ * attached ones. Those that exited stay, but are no longer live. */
+int nr_pids = 0;
+pid_t pids [MAX_OBSERVED];
+int pid_live [MAX_OBSERVED];
+
+/* Cgroup each attached process was moved from by -Z, where it goes
+ * back when done */
+char * pid_origin [MAX_OBSERVED];
+
+/* Start time of each attached process, in clock ticks after boot.
+ * Attached processes are not children: their PID can be reused as
+ * soon as they exit, by a process that must not be touched. */
+unsigned long long pid_start [MAX_OBSERVED];
+
+/* Running processes to attach to */
+#define ATTACH_PID           0
+#define ATTACH_CGROUP        1
+#define ATTACH_COMM          2
+
+struct attach_spec {
+	int kind;
+	pid_t pid;
+	char arg[FILTER_PATH_MAX];	/* Cgroup path or comm */
+};
+
+struct attach_spec attach[MAX_ATTACH];
+int nr_attach = 0;
 
 int max_prio;
 
 volatile int done = 0;
 int snapshots = 0;
 
+/* Read-only view of the sample buffers exported by the module */
+char * shutter_buf = NULL;
+size_t shutter_mapped = 0;
+
+/* Geometry of the L2, as reported by the module */
+struct cache_geometry geom;
+
+/* Size of a sample in the full format, and sections that follow
+ * the lines */
+size_t sample_size;
+uint32_t full_sections = 0;
+
+/* How CSV files are written */
+struct csv_options csv_opts = { 0, 1 };
+
+/* Binary capture file, and samples saved to it */
+int capture_fd = -1;
+uint32_t captured = 0;
+
+/* Content of the last snapshot decoded from variable-size records */
+struct sample_state cur_state;
+
+/* Size of the sample ring, and number of samples saved from it */
+size_t ring_len = 0;
+int saved = 0;
+
+/* Content of /proc/pid/maps of a process at snapshot time */
+struct maps_copy {
+	pid_t pid;
+	char * buf;
+	size_t len;
+	size_t capacity;
+};
+
+/* Snapshot grabbed by take_snapshot() and left for the writer
+ * thread to save. A negative index stops the writer. */
+struct pending_snapshot {
+	int index;
+	uint64_t timestamp;	/* When it was acquired, as in the capture */
+	size_t size;		/* Bytes of sample, 0 if none was grabbed */
+	size_t capacity;
+	char * sample;
+	int nr_maps;
+	struct maps_copy maps[MAX_OBSERVED];
+};
+
+/* Pool of pending snapshots, used as a ring between the main thread
+ * (head) and the writer thread (tail). Free and full slots are
+ * counted by semaphores. */
+int writer_slots = WRITER_SLOTS;
+struct pending_snapshot * pool = NULL;
+unsigned int pool_head = 0;
+unsigned int pool_tail = 0;
+sem_t pool_free;
+sem_t pool_full;
+pthread_t writer;
+
+/* Snapshots delayed because the writer thread had no free slot */
+int writer_waits = 0;
+
+/* Periodic deadlines that passed while taking a snapshot */
+uint64_t missed_deadlines = 0;
+
+/* Cgroup the benchmarks run in, if they are stopped by freezing it,
+ * and its cgroup.freeze (or v1 freezer.state) and cgroup.events */
+char * freezer_path = NULL;
+int freezer_fd = -1;
+int freezer_events_fd = -1;
+int freezer_v1 = 0;
+int freezer_created = 0;
+
+/* Set while the observed processes are stopped for a snapshot */
+int targets_stopped = 0;
+
+/* Mount point of the hierarchy of that cgroup, and its own directory
+ * with symlinks resolved */
+char freezer_root [PATH_MAX];
+char freezer_dir [PATH_MAX];
+
 /* Use user-specified parameters to configure the kernel module for
  * acquisition */
 int config_shutter(void);
@@ -86,14 +332,44 @@ int config_shutter(void);
 /* Function to spawn all the listed benchmarks */
 void launch_benchmarks(void);
 
-/* Handler for SIGCHLD signal to detect benchmark termination */
-void proc_exit_handler (int signo, siginfo_t * info, void * extra);
+/* Tell the module which processes are under observation */
+void set_targets(void);
+
+/* Whether the module has to know the processes under observation */
+int module_needs_targets(void);
+
+/* Parse an attach specification of the command line */
+int parse_attach(char * spec);
+
+/* Attach to the processes matching the specifications, and forget
+ * the attached ones that exited. Returns 1 if anything changed. */
+int discover_targets(int first);
+
+/* Create the cgroup the benchmarks are frozen through */
+void setup_freezer(void);
+
+/* Move a process, 0 for the calling one, into the cgroup of the
+ * benchmarks */
+int join_freezer(pid_t pid);
+
+/* Thaw and remove the cgroup of the benchmarks */
+void teardown_freezer(void);
+
+/* Resume the observed processes if exiting in the middle of a
+ * snapshot. Registered with atexit. */
+void release_targets(void);
+
+/* Collect the benchmarks that terminated, after a SIGCHLD */
+void reap_benchmarks(void);
 
 /* Ask the kernel to acquire a new snapshot */
 void acquire_new_snapshot(void);
 
-/* Handler for SIGRTMAX signal to initiate new snapshot */
-void snapshot_handler (int signo, siginfo_t * info, void * extra);
+/* Take the snapshot of a periodic deadline when the timer expires */
+void periodic_snapshot(int timer_fd);
+
+/* Stop the benchmarks, acquire a snapshot and resume them */
+void take_snapshot(void);
 
 /* Set real-time SCHED_FIFO scheduler with given priority */
 void set_realtime(int prio);
@@ -104,11 +380,35 @@ void change_rt_prio(int prio);
 /* Set non-real-time SCHED_OTHER scheduler */
 void set_non_realtime(void);
 
-/* Install periodic snapshot handler and wait for completion using signals */
+/* Take snapshots from an event loop until the benchmarks complete */
 void wait_completion(void);
 
-/* Entry function to interface with the kernel module via the proc interface */
-void read_cache_to_file(char * filename, int index);
+/* Start the writer thread, if snapshots are not saved in place */
+void start_writer(void);
+
+/* Let the writer thread save the pending snapshots and exit */
+void stop_writer(void);
+
+/* Make sure that at least the first len bytes of the buffers are mapped */
+char * map_buffers(size_t len);
+
+/* Entry function to interface with the kernel module via the proc
+ * interface. Returns the offset of the sample that follows. */
+size_t read_cache_to_file(char * filename, size_t offset, uint64_t timestamp);
+
+/* Save a sample copied out of the buffers of the module. The
+ * timestamp is when it was acquired, 0 if unknown. */
+void save_sample(char * filename, const void * sample, size_t size, uint64_t timestamp);
+
+/* Create the binary capture file and describe the run in it */
+void capture_open(unsigned long config);
+
+/* Append a sample to the binary capture file */
+void capture_append(const void * sample, uint32_t size, uint64_t timestamp);
+
+/* Save all the samples pending in the ring to disk, optionally
+ * waiting for at least one to become available */
+void drain_ring(int wait);
 
 /* Function to complete execution */
 void wrap_up(void);
@@ -119,7 +419,7 @@ int main (int argc, char ** argv)
 	int opt, res;
 	struct stat dir_stat;
 	
-	while ((opt = getopt(argc, argv, "-rmafio:p:ntlh")) != -1) {
+	while ((opt = getopt(argc, argv, "-rmafio:p:ntlhcd:jesbk:g:R:W:LMTPKE:S:F:A:Q:Z:X:")) != -1) {
 		switch (opt) {
 		case 1:
 		{
@@ -198,6 +498,199 @@ int main (int argc, char ** argv)
 			flag_overhead = 1;
 			break;
 		}
+		case 'c':
+		{
+			/* Store samples in the packed format */
+			flag_packed = 1;
+			break;
+		}
+		case 'j':
+		{
+			/* Let the stalled CPUs help with the dump */
+			flag_parallel = 1;
+			break;
+		}
+		case 'e':
+		{
+			/* Resolve addresses outside of the stall */
+			flag_defer = 1;
+			break;
+		}
+		case 's':
+		{
+			/* Drain samples while acquiring */
+			flag_stream = 1;
+			flag_transparent = 1;
+			break;
+		}
+		case 'X':
+		{
+			/* Observe processes that are already running */
+			if (parse_attach(optarg) < 0) {
+				fprintf(stderr, USAGE_STR, argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case 'Z':
+		{
+			/* Stop the benchmarks by freezing their cgroup */
+			freezer_path = optarg;
+			break;
+		}
+		case 'Q':
+		{
+			/* Depth of the queue of the writer thread */
+			writer_slots = strtol(optarg, NULL, 10);
+			if (writer_slots < 0) {
+				fprintf(stderr, "Invalid number of writer slots: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case 'b':
+		{
+			/* Save samples in a binary capture file */
+			flag_binary = 1;
+			break;
+		}
+		case 'k':
+		{
+			/* Let the kernel time the snapshots */
+			flag_kernel_timer = 1;
+			flag_transparent = 1;
+			kernel_period_us = strtol(optarg, NULL, 10);
+
+			if (kernel_period_us <= 0) {
+				fprintf(stderr, USAGE_STR, argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case 'g':
+		{
+			/* Let a PMU counter trigger the snapshots */
+			flag_kernel_trigger = 1;
+			flag_transparent = 1;
+
+			if (sscanf(optarg, "%i:%lu:%u", &kernel_trigger.event,
+				   &kernel_trigger.period, &kernel_trigger.cpu) != 3 ||
+			    kernel_trigger.period == 0) {
+				fprintf(stderr, USAGE_STR, argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case 'S':
+		{
+			/* Leave some CPUs running during snapshots */
+			if (!strcmp(optarg, "all")) {
+				stall_policy.policy = STALL_POLICY_ALL;
+			} else if (!strcmp(optarg, "targets")) {
+				stall_policy.policy = STALL_POLICY_TARGETS;
+			} else {
+				stall_policy.policy = STALL_POLICY_CPUMASK;
+				stall_policy.cpus = strtoull(optarg, NULL, 0);
+			}
+			break;
+		}
+		case 'F':
+		{
+			/* Only resolve the lines we care about */
+			if (!strcmp(optarg, "targets")) {
+				filter.mode = FILTER_TARGETS;
+			} else {
+				filter.mode = FILTER_CGROUP;
+				strncpy(filter.cgroup, optarg, FILTER_PATH_MAX - 1);
+			}
+			break;
+		}
+		case 'K':
+		{
+			/* Tell kernel pages apart */
+			flag_classify = 1;
+			break;
+		}
+		case 'A':
+		{
+			/* Only store occupancy summaries */
+			flag_aggregate = 1;
+			if (!strcmp(optarg, "cgroup")) {
+				flag_agg_cgroups = 1;
+			} else if (strcmp(optarg, "pid")) {
+				fprintf(stderr, USAGE_STR, argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case 'R':
+		{
+			/* Capture a range of sets only */
+			if (sscanf(optarg, "%u:%u", &selection.first_set,
+				   &selection.last_set) != 2) {
+				fprintf(stderr, USAGE_STR, argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case 'M':
+		{
+			/* Output coherence states */
+			flag_state = 1;
+			break;
+		}
+		case 'L':
+		{
+			/* Capture the private arrays of the cores */
+			flag_cores = 1;
+			break;
+		}
+		case 'T':
+		{
+			/* Time each snapshot */
+			flag_timing = 1;
+			break;
+		}
+		case 'P':
+		{
+			/* Read the PMU with each snapshot */
+			flag_pmu = 1;
+			break;
+		}
+		case 'E':
+		{
+			/* Custom PMU events */
+			char * tok = strtok(optarg, ",");
+			int i = 0;
+
+			for (i = 0; i < MAX_PMU_EVENTS; i++)
+				pmu_events.events[i] = PMU_EVENT_NONE;
+
+			for (i = 0; tok && i < MAX_PMU_EVENTS; i++, tok = strtok(NULL, ","))
+				pmu_events.events[i] = strtoul(tok, NULL, 0);
+
+			if (i == 0 || tok) {
+				fprintf(stderr, USAGE_STR, argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			
+			pmu_events_set = 1;
+			flag_pmu = 1;
+			break;
+		}
+		case 'W':
+		{
+			/* Capture some of the ways only */
+			selection.way_mask = strtoul(optarg, NULL, 0);
+			break;
+		}
+		case 'd':
+		{
+			/* Store only changes between snapshots */
+			flag_delta = 1;
+			keyframe_period = strtol(optarg, NULL, 10);
+			break;
+		}
 		case 'o':
 		{
 			/* Custom output dir requested */
@@ -216,7 +709,7 @@ int main (int argc, char ** argv)
 		}
 	} 
 
-	if (bm_count == 0) {
+	if (bm_count == 0 && nr_attach == 0) {
 		fprintf(stderr, USAGE_STR, argv[0]);
 		exit(EXIT_FAILURE);		
 	}
@@ -245,10 +738,27 @@ int main (int argc, char ** argv)
 	/* Send setup commands to the kernel module */
 	config_shutter();
 	
+	/* The cgroup has to exist before the benchmarks join it */
+	if (freezer_path)
+		setup_freezer();
+
+	/* Error paths exit from anywhere, possibly with the observed
+	 * processes stopped */
+	atexit(release_targets);
+
 	/* Done with command line parsing -- time to fire up the benchmarks */
 	launch_benchmarks();
 
-	/* Done with benchmarks --- wait for completion using an asynch handler */
+	/* Then attach to the processes already running */
+	if (nr_attach)
+		discover_targets(1);
+
+	/* Only now do we know which CPUs to stall and which lines to
+	 * resolve */
+	if (module_needs_targets())
+		set_targets();
+
+	/* Done with benchmarks --- wait for completion in the event loop */
 	wait_completion();
 
 	/* Almost done - wrap up by creating pid.txt file */
@@ -282,6 +792,7 @@ int config_shutter(void)
 	int dumpcache_fd;
 	int err;
 	unsigned long cmd = 0;
+	struct ring_status status;
 
 	dumpcache_fd = open_mod();
 	
@@ -303,6 +814,101 @@ int config_shutter(void)
 	} else {
 		cmd |= DUMPCACHE_CMD_RESOLVE_DIS_SHIFT;
 	}
+
+	/* Select the sample format */
+	if (flag_packed == 1) {
+		cmd |= DUMPCACHE_CMD_PACKED_EN_SHIFT;
+	} else {
+		cmd |= DUMPCACHE_CMD_PACKED_DIS_SHIFT;
+	}
+
+	if (flag_delta == 1) {
+		cmd |= DUMPCACHE_CMD_DELTA_EN_SHIFT;
+	} else {
+		cmd |= DUMPCACHE_CMD_DELTA_DIS_SHIFT;
+	}
+
+	if (flag_aggregate == 1) {
+		cmd |= DUMPCACHE_CMD_AGGREGATE_EN_SHIFT;
+	} else {
+		cmd |= DUMPCACHE_CMD_AGGREGATE_DIS_SHIFT;
+	}
+
+	if (flag_agg_cgroups == 1) {
+		cmd |= DUMPCACHE_CMD_AGG_CGROUPS_EN_SHIFT;
+	} else {
+		cmd |= DUMPCACHE_CMD_AGG_CGROUPS_DIS_SHIFT;
+	}
+
+	if (flag_classify == 1) {
+		cmd |= DUMPCACHE_CMD_CLASSIFY_EN_SHIFT;
+	} else {
+		cmd |= DUMPCACHE_CMD_CLASSIFY_DIS_SHIFT;
+	}
+
+	if (flag_parallel == 1) {
+		cmd |= DUMPCACHE_CMD_PARALLEL_EN_SHIFT;
+	} else {
+		cmd |= DUMPCACHE_CMD_PARALLEL_DIS_SHIFT;
+	}
+
+	if (flag_defer == 1) {
+		cmd |= DUMPCACHE_CMD_DEFER_EN_SHIFT;
+	} else {
+		cmd |= DUMPCACHE_CMD_DEFER_DIS_SHIFT;
+	}
+
+	if (flag_cores == 1) {
+		cmd |= DUMPCACHE_CMD_CORES_EN_SHIFT;
+	} else {
+		cmd |= DUMPCACHE_CMD_CORES_DIS_SHIFT;
+	}
+
+	if (flag_timing == 1) {
+		cmd |= DUMPCACHE_CMD_TIMESTAMP_EN_SHIFT;
+	} else {
+		cmd |= DUMPCACHE_CMD_TIMESTAMP_DIS_SHIFT;
+	}
+
+	if (flag_pmu == 1) {
+		cmd |= DUMPCACHE_CMD_PMU_EN_SHIFT;
+	} else {
+		cmd |= DUMPCACHE_CMD_PMU_DIS_SHIFT;
+	}
+
+	if (flag_delta == 1 && keyframe_period > 0) {
+		err = ioctl(dumpcache_fd, DUMPCACHE_CMD_KEYFRAME, keyframe_period);
+		if (err) {
+			perror("Unable to set keyframe period");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	if (pmu_events_set) {
+		err = ioctl(dumpcache_fd, DUMPCACHE_CMD_PMU_EVENTS, &pmu_events);
+		if (err) {
+			perror("Invalid PMU events");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	err = ioctl(dumpcache_fd, DUMPCACHE_CMD_STALL, &stall_policy);
+	if (err) {
+		perror("Invalid stall policy");
+		exit(EXIT_FAILURE);
+	}
+	
+	err = ioctl(dumpcache_fd, DUMPCACHE_CMD_FILTER, &filter);
+	if (err) {
+		perror("Invalid filter");
+		exit(EXIT_FAILURE);
+	}
+	
+	err = ioctl(dumpcache_fd, DUMPCACHE_CMD_SELECT, &selection);
+	if (err) {
+		perror("Invalid set range or way mask");
+		exit(EXIT_FAILURE);
+	}
 	
 	err = ioctl(dumpcache_fd, DUMPCACHE_CMD_CONFIG, cmd);
 	if (err) {
@@ -310,13 +916,179 @@ int config_shutter(void)
 		exit(EXIT_FAILURE);
 	}
 
-	printf("Module config OKAY!\n");
+	/* Samples are laid out according to the geometry of the L2 */
+	err = ioctl(dumpcache_fd, DUMPCACHE_CMD_GEOMETRY, &geom);
+	if (err) {
+		perror("Unable to retrieve L2 geometry");
+		exit(EXIT_FAILURE);
+	}
+
+	sample_size = geom.sets * geom.ways * sizeof(struct cache_line) +
+		sizeof(struct sample_hdr);
+	if (flag_cores) {
+		sample_size += CORE_SECTION_SIZE;
+		full_sections |= SAMPLE_FLAG_CORES;
+	}
+	if (flag_pmu) {
+		sample_size += PMU_SECTION_SIZE;
+		full_sections |= SAMPLE_FLAG_PMU;
+	}
+	if (flag_timing) {
+		sample_size += TIMING_SECTION_SIZE;
+		full_sections |= SAMPLE_FLAG_TIMING;
+	}
+
+	csv_opts.state = flag_state;
+	if (flag_binary && !flag_mimic)
+		capture_open(cmd);
+
+	if (sample_state_init(&cur_state, &geom) < 0) {
+		perror("Unable to allocate sample state");
+		exit(EXIT_FAILURE);
+	}
+
+	err = ioctl(dumpcache_fd, DUMPCACHE_CMD_RING_STATUS, &status);
+	if (err) {
+		perror("Unable to retrieve ring status");
+		exit(EXIT_FAILURE);
+	}
+
+	ring_len = status.len;
+	
+	printf("Module config OKAY! L2: %u sets, %u ways\n", geom.sets, geom.ways);
 	
 	close(dumpcache_fd);
 
 	return err;
 }
 
+/* Cgroup of a process in the hierarchy of the freezer, as a
+ * directory. NULL if it cannot be told. */
+static char * cgroup_of(pid_t pid)
+{
+	static char line[PATH_MAX];
+	char pathname[MALLOC_CMD_PAD];
+	char * controllers, * path, * dir = NULL;
+	FILE * in;
+
+	sprintf(pathname, "/proc/%d/cgroup", pid);
+	if (!(in = fopen(pathname, "r")))
+		return NULL;
+
+	/* Lines are id:controllers:path. The v2 hierarchy has none. */
+	while (!dir && fgets(line, sizeof(line), in)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!(controllers = strchr(line, ':')) ||
+		    !(path = strchr(++controllers, ':')))
+			continue;
+		*path++ = '\0';
+
+		if (freezer_v1 ? !!strstr(controllers, "freezer") : !*controllers) {
+			dir = (char *)malloc(strlen(freezer_root) + strlen(path) + 1);
+			sprintf(dir, "%s%s", freezer_root, strcmp(path, "/") ? path : "");
+		}
+	}
+
+	fclose(in);
+	return dir;
+}
+
+/* Move a process, 0 for the calling one, into the cgroup at dir */
+static int cgroup_move(const char * dir, pid_t pid)
+{
+	static char pathname[PATH_MAX];
+	char buf[MALLOC_CMD_PAD];
+	int fd, len, ret = 0;
+
+	len = sprintf(buf, "%d", pid);
+	snprintf(pathname, PATH_MAX, "%s/cgroup.procs", dir);
+	if ((fd = open(pathname, O_WRONLY)) < 0)
+		return -1;
+
+	if (write(fd, buf, len) != len)
+		ret = -1;
+
+	close(fd);
+	return ret;
+}
+
+/* Add a process to the ones under observation. Returns -1 if there
+ * is no room left. */
+static int observe_pid(pid_t pid)
+{
+	if (nr_pids == MAX_OBSERVED)
+		return -1;
+
+	pids[nr_pids] = pid;
+	pid_live[nr_pids] = 1;
+
+	return nr_pids++;
+}
+
+/* Index of a live process under observation, or -1 */
+static int find_observed(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < nr_pids; ++i) {
+		if (pids[i] == pid && pid_live[i])
+			return i;
+	}
+
+	return -1;
+}
+
+/* Fields of /proc/pid/stat after the comm, which can contain
+ * anything. Returns NULL if the process is gone. */
+static char * stat_fields(pid_t pid, char * buf, size_t size)
+{
+	static char pathname[MALLOC_CMD_PAD];
+	char * comm_end;
+	ssize_t len;
+	int fd;
+
+	sprintf(pathname, "/proc/%d/stat", pid);
+	if ((fd = open(pathname, O_RDONLY)) < 0)
+		return NULL;
+	len = read(fd, buf, size - 1);
+	close(fd);
+
+	if (len <= 0)
+		return NULL;
+	buf[len] = '\0';
+
+	if (!(comm_end = strrchr(buf, ')')))
+		return NULL;
+
+	return comm_end + 1;
+}
+
+/* Start time of a process, 0 if it is gone */
+static unsigned long long start_time_of(pid_t pid)
+{
+	unsigned long long start;
+	char buf[BUF_SIZE];
+	char * fields;
+
+	/* The start time is the 22nd field, the comm the 2nd */
+	if (!(fields = stat_fields(pid, buf, sizeof(buf))) ||
+	    sscanf(fields, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u"
+		   " %*d %*d %*d %*d %*d %*d %llu", &start) != 1)
+		return 0;
+
+	return start;
+}
+
+/* Whether an observed process still runs. Benchmarks are reaped by
+ * us, so their PID cannot be reused while they are live. */
+static int still_running(int i)
+{
+	if (!pid_live[i])
+		return 0;
+
+	return i < bm_count || start_time_of(pids[i]) == pid_start[i];
+}
+
 /* Function to spawn all the listed benchmarks */
 void launch_benchmarks (void)
 {
@@ -344,6 +1116,9 @@ void launch_benchmarks (void)
 				args[1]++;			
 			}
 
+			if (freezer_path)
+				join_freezer(0);
+
 			/* Set SCHED_FIFO priority if necessary */
 			if (flag_rt) {
 				change_rt_prio(max_prio -1 -i);
@@ -365,7 +1140,8 @@ void launch_benchmarks (void)
 			printf("Running: %s (PID = %d, prio = %d)\n", bms[i], cpid,
 			       (flag_rt?(max_prio -1 -i):0));
 			
-			pids[running_bms++] = cpid;
+			observe_pid(cpid);
+			running_bms++;
 			//cpid_arr[i*NUM_SD_VBS_BENCHMARKS_DATASETS+j] = cpid;
 		}
 		
@@ -374,22 +1150,245 @@ void launch_benchmarks (void)
 	
 }
 
-/* Handler for SIGCHLD signal to detect benchmark termination */
-/* Adapted from https://docs.oracle.com/cd/E19455-01/806-4750/signals-7/index.html */
-void proc_exit_handler (int signo, siginfo_t * info, void * extra)
+/* Tell the module which processes are under observation */
+void set_targets(void)
 {
-	int wstat;
+	struct dump_targets targets;
+	int dumpcache_fd, i;
+
+	targets.count = 0;
+	for (i = 0; i < nr_pids; i++) {
+		if (!pid_live[i])
+			continue;
+
+		if (targets.count == MAX_TARGETS) {
+			fprintf(stderr, "WARNING: Only the first " STR(MAX_TARGETS)
+				" processes are targets of the module.\n");
+			break;
+		}
+		targets.pids[targets.count++] = pids[i];
+	}
+
+	/* Not fatal: the previous targets stay, and the next
+	 * rediscovery tries again */
+	dumpcache_fd = open_mod();
+	if (ioctl(dumpcache_fd, DUMPCACHE_CMD_TARGETS, &targets) < 0)
+		perror("WARNING: Unable to set target processes");
+	close(dumpcache_fd);
+}
+
+int module_needs_targets(void)
+{
+	return (stall_policy.policy == STALL_POLICY_TARGETS ||
+		filter.mode == FILTER_TARGETS) && !flag_mimic;
+}
+
+int parse_attach(char * spec)
+{
+	char * pid, * end;
+
+	if (!strncmp(spec, "pid:", 4)) {
+		/* One specification per PID */
+		for (pid = strtok(spec + 4, ","); pid; pid = strtok(NULL, ",")) {
+			if (nr_attach == MAX_ATTACH)
+				return -1;
+
+			attach[nr_attach].kind = ATTACH_PID;
+			attach[nr_attach].pid = strtol(pid, &end, 10);
+			if (*end || attach[nr_attach].pid <= 0)
+				return -1;
+			nr_attach++;
+		}
+		return 0;
+	}
+
+	if (nr_attach == MAX_ATTACH)
+		return -1;
+
+	if (!strncmp(spec, "cgroup:", 7)) {
+		attach[nr_attach].kind = ATTACH_CGROUP;
+		spec += 7;
+	} else if (!strncmp(spec, "comm:", 5)) {
+		attach[nr_attach].kind = ATTACH_COMM;
+		spec += 5;
+	} else {
+		return -1;
+	}
+
+	strncpy(attach[nr_attach].arg, spec, FILTER_PATH_MAX - 1);
+	nr_attach++;
+	return 0;
+}
+
+/* Start observing a process found by an attach specification.
+ * Returns 1 if it was not observed yet. */
+static int attach_pid(pid_t pid)
+{
+	static char pathname[MALLOC_CMD_PAD];
+	char comm[COMM_LEN] = "";
+	unsigned long long start;
+	FILE * in;
+	int i;
+
+	if (pid == getpid() || find_observed(pid) >= 0)
+		return 0;
+
+	/* It might have exited in the meantime */
+	if (!(start = start_time_of(pid)))
+		return 0;
+	sprintf(pathname, "/proc/%d/comm", pid);
+	if (!(in = fopen(pathname, "r")))
+		return 0;
+	if (fscanf(in, "%15[^\n]", comm) != 1)
+		comm[0] = '\0';
+	fclose(in);
+
+	if ((i = observe_pid(pid)) < 0) {
+		fprintf(stderr, "WARNING: Not attaching to PID %d. "
+			"Up to " STR(MAX_OBSERVED) " processes can be observed.\n", pid);
+		return 0;
+	}
+	pid_start[i] = start;
+
+	/* Attached processes are frozen along with the benchmarks,
+	 * unless they already are in that cgroup */
+	if (freezer_path) {
+		pid_origin[i] = cgroup_of(pid);
+		if (pid_origin[i] && !strcmp(pid_origin[i], freezer_dir)) {
+			free(pid_origin[i]);
+			pid_origin[i] = NULL;
+		} else if (join_freezer(pid) < 0) {
+			/* Gone before it could be moved: it was the
+			 * last one observed */
+			free(pid_origin[i]);
+			pid_origin[i] = NULL;
+			--nr_pids;
+			return 0;
+		}
+	}
+
+	printf("Attached to: %s (PID = %d)\n", comm, pid);
+	return 1;
+}
+
+/* Attach to the processes of a cgroup v2, not below it */
+static int attach_cgroup(const char * path)
+{
+	static char pathname[PATH_MAX];
+	int found = 0;
+	FILE * in;
+	pid_t pid;
+
+	/* A cgroup that is gone, or not there yet, has no live
+	 * processes */
+	snprintf(pathname, PATH_MAX, CGROUP_ROOT "%s/cgroup.procs", path);
+	if (!(in = fopen(pathname, "r")))
+		return 0;
+
+	while (fscanf(in, "%d", &pid) == 1)
+		found += attach_pid(pid);
+
+	fclose(in);
+	return found;
+}
+
+/* Attach to the processes with the given name, as in /proc/pid/comm */
+static int attach_comm(const char * name)
+{
+	static char pathname[MALLOC_CMD_PAD];
+	char comm[COMM_LEN];
+	struct dirent * entry;
+	int found = 0;
+	DIR * proc;
+	FILE * in;
+	char * end;
+	pid_t pid;
+
+	if (!(proc = opendir("/proc"))) {
+		perror("Unable to list processes");
+		exit(EXIT_FAILURE);
+	}
+
+	while ((entry = readdir(proc))) {
+		pid = strtol(entry->d_name, &end, 10);
+		if (*end || pid <= 0)
+			continue;
+
+		sprintf(pathname, "/proc/%d/comm", pid);
+		if (!(in = fopen(pathname, "r")))
+			continue;
+
+		if (fscanf(in, "%15[^\n]", comm) == 1 &&
+		    !strncmp(comm, name, COMM_LEN - 1))
+			found += attach_pid(pid);
+		fclose(in);
+	}
+
+	closedir(proc);
+	return found;
+}
+
+int discover_targets(int first)
+{
+	int changed = 0;
+	int i, live = 0;
+
+	/* Attached processes are not children: notice when they
+	 * are gone */
+	for (i = bm_count; i < nr_pids; ++i) {
+		if (pid_live[i] && !still_running(i)) {
+			printf("PID %d Gone.\n", pids[i]);
+			pid_live[i] = 0;
+			changed = 1;
+		}
+	}
+
+	for (i = 0; i < nr_attach; ++i) {
+		switch (attach[i].kind) {
+		case ATTACH_PID:
+			/* Explicit PIDs do not come back */
+			if (!first)
+				break;
+			if (attach_pid(attach[i].pid))
+				changed = 1;
+			else if (find_observed(attach[i].pid) < 0)
+				fprintf(stderr, "WARNING: PID %d does not exist.\n", attach[i].pid);
+			break;
+		case ATTACH_CGROUP:
+			changed |= attach_cgroup(attach[i].arg);
+			break;
+		case ATTACH_COMM:
+			changed |= attach_comm(attach[i].arg);
+			break;
+		}
+	}
+
+	/* Without benchmarks, stop when nothing is left to observe */
+	for (i = 0; i < nr_pids; ++i)
+		live += pid_live[i];
+	if (!bm_count && !live) {
+		printf("No process left to observe.\n");
+		done = 1;
+	}
+
+	return changed;
+}
+
+/* Detect benchmark termination */
+/* Adapted from https://docs.oracle.com/cd/E19455-01/806-4750/signals-7/index.html */
+void reap_benchmarks(void)
+{
+	int wstat, i;
 	pid_t pid;
-	
-	(void)signo;
-	(void)info;
-	(void)extra;
 	
 	for (;;) {
 		pid = waitpid (-1, &wstat, WNOHANG);
 		if (pid == 0)
 			/* No change in the state of the child(ren) */
 			return;
+		else if (pid == -1 && errno == ECHILD)
+			/* Only attached processes are observed */
+			return;
 		else if (pid == -1) {
 			/* Something went wrong */
 			perror("Waitpid() exited with error");
@@ -399,6 +1398,9 @@ void proc_exit_handler (int signo, siginfo_t * info, void * extra)
 		else {
 			printf ("PID %d Done. Return code: %d\n", pid, WEXITSTATUS(wstat));
 
+			if ((i = find_observed(pid)) >= 0)
+				pid_live[i] = 0;
+
 			/* Detect completion of all the benchmarks */
 			if(--running_bms == 0) {
 				done = 1;
@@ -409,7 +1411,6 @@ void proc_exit_handler (int signo, siginfo_t * info, void * extra)
 }
 
 /* Copy content of file from src to dst */
-#define BUF_SIZE (1024)
 void copy_file(char * src, char * dst)
 {
 	static char buf [BUF_SIZE];
@@ -454,145 +1455,29 @@ void acquire_new_snapshot(void)
 	close(dumpcache_fd);
 }
 
-/* Handler for SIGRTMAX signal to initiate new snapshot */
-void snapshot_handler (int signo, siginfo_t * info, void * extra)
+/* Deadlines are absolute and the timer is periodic, so the time
+ * spent taking snapshots does not shift the following ones */
+void periodic_snapshot(int timer_fd)
 {
-	(void)signo;
-	(void)extra;
-
-	static char * __cmd = NULL;
-	static char __proc_entry[MALLOC_CMD_PAD];
-	
-	static struct itimerspec it = {
-		.it_value.tv_sec = 0,
-		.it_value.tv_nsec = 0,
-		.it_interval.tv_sec = 0,
-		.it_interval.tv_nsec = 0, /* One shot mode */
-	};
-	
-	timer_t timer = *((timer_t *)(info->si_value.sival_ptr));
-	int i;
-
-
-	/* Set next activation */
-	it.it_value.tv_nsec = MS_TO_NS(snap_period_ms);
-		
-	/* Should happen only once */
-	if (!__cmd)
-		__cmd = (char *)malloc(strlen(outdir) + MALLOC_CMD_PAD);
-
-	/* Send SIGSTOP to all the children (skip in async mode) */
-	for (i = 0; i < bm_count && !flag_async; ++i) {
-		kill(pids[i], SIGSTOP);
-	}
-	
-	/* Skip all of this in mimic mode */
-	if(!flag_mimic) {
-		/* Ask the module to acquire a new snapshot.*/
-		acquire_new_snapshot();
-
-		/* Unless we are in transparent mode, save cache dump
-		 * to file right away */
-		if (!flag_transparent) {
-			sprintf(__cmd, "%s/cachedump%d.csv", outdir, snapshots);
+	static const struct itimerspec disarm;
+	uint64_t expirations;
 
-			/* In non-transparent mode, no autoincrement
-			 * is selected in the kernel, so we always
-			 * read the first buffer. */
-			read_cache_to_file(__cmd, 0);
-		}
-	}
+	if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
 
-	/* Acquire maps files if layout acquisition is selected */
-	if (flag_bm_layout) {
-		/* Initiate a /proc/pid/maps dump to file */
-		for (i = 0; i < bm_count; ++i) {
-			sprintf(__cmd, "%s/%d-%d.txt", outdir, pids[i], snapshots);
-			sprintf(__proc_entry, "/proc/%d/maps", pids[i]);
-			copy_file(__proc_entry, __cmd);
-		}
-	}
+	/* Deadlines that passed meanwhile are skipped, not made up */
+	missed_deadlines += expirations - 1;
 
-	/* Resume all the children with SIGCONT (skip in async mode) */
-	for (i = 0; i < bm_count && !flag_async; ++i) {
-		kill(pids[i], SIGCONT);
-	}
-		
-	/* Keep track of the total number of snapshots acquired so far */
-	++snapshots;
+	take_snapshot();
 	
-	/* If this is snapshot #1, then just acquire another snapshot
+	/* If this is snapshot #2, then just acquire another snapshot
 	 * right away and that will be it. */
-	if (flag_overhead) {
-		if (snapshots == 1) {
-			/* Set timer's next activation */
-			timer_settime(timer, 0, &it, NULL);			
-		}
-		if (snapshots == 2) {
-			snapshot_handler (signo, info, extra);
-		}
-	} else {
-		/* Set timer's next activation */
-		timer_settime(timer, 0, &it, NULL);		
-	}
-	
-}
-
-/* Handler for SIGRTMAX-1 signal to initiate new snapshot */
-void ext_snapshot_handler (int signo, siginfo_t * info, void * extra)
-{
-	(void)signo;
-	(void)extra;
-
-	static char * __cmd = NULL;
-	static char __proc_entry[MALLOC_CMD_PAD];
-	
-	int i;
-	
-	/* Should happen only once */
-	if (!__cmd)
-		__cmd = (char *)malloc(strlen(outdir) + MALLOC_CMD_PAD);
+	if (flag_overhead && snapshots >= 2) {
+		if (snapshots == 2)
+			take_snapshot();
 
-	/* Send SIGSTOP to all the children (skip in async mode) */
-	for (i = 0; i < bm_count && !flag_async; ++i) {
-		kill(pids[i], SIGSTOP);
+		timerfd_settime(timer_fd, 0, &disarm, NULL);
 	}
-	
-	/* Skip all of this in mimic mode */
-	if(!flag_mimic) {
-		/* Ask the module to acquire a new snapshot.*/
-		acquire_new_snapshot();
-
-		/* Unless we are in transparent mode, save cache dump
-		 * to file right away */
-		if (!flag_transparent) {
-			sprintf(__cmd, "%s/cachedump%d.csv", outdir, snapshots);
-
-			/* In non-transparent mode, no autoincrement
-			 * is selected in the kernel, so we always
-			 * read the first buffer. */
-			read_cache_to_file(__cmd, 0);
-		}
-	}
-
-	/* Acquire maps files if layout acquisition is selected */
-	if (flag_bm_layout) {
-		/* Initiate a /proc/pid/maps dump to file */
-		for (i = 0; i < bm_count; ++i) {
-			sprintf(__cmd, "%s/%d-%d.txt", outdir, pids[i], snapshots);
-			sprintf(__proc_entry, "/proc/%d/maps", pids[i]);
-			copy_file(__proc_entry, __cmd);
-		}
-	}
-
-	/* Resume all the children with SIGCONT (skip in async mode) */
-	for (i = 0; i < bm_count && !flag_async; ++i) {
-		kill(pids[i], SIGCONT);
-	}
-		
-	/* Keep track of the total number of snapshots acquired so far */
-	++snapshots;
-	
 }
 
 
@@ -604,33 +1489,23 @@ void wrap_up (void)
 	
 	pathname = (char *)malloc(strlen(outdir) + MALLOC_CMD_PAD);
 
-	/* If we are running in transparent mode, now it's the time to
-	 * dump all the snapshots. */
-	if (flag_transparent) {
-		int dumpcache_fd = open_mod();
-		int retval;
-
-		retval = ioctl(dumpcache_fd, DUMPCACHE_CMD_CONFIG, DUMPCACHE_CMD_GETBUF_SHIFT);
-		if (retval < 0) {
-			perror("Unable to retrieve current buffer index from shutter");
-			exit(EXIT_FAILURE);
-		}
+	/* Save the snapshots still queued */
+	stop_writer();
 
-		/* The read_cache_to_file function will re-open this
-		 * file. So close it for now. */
-		close(dumpcache_fd);
-		
-		/* If the number of snapshots is in mismatch,
-		 * something is wrong! */
-		if (retval != snapshots) 
-			fprintf(stderr, "WARNING: Number of snapshots does not match the expected"
-				"value. Possible overflow?\n");
-		
-		for (i = 0; i < retval; ++i) {
-			sprintf(pathname, "%s/cachedump%d.csv", outdir, i);
-			read_cache_to_file(pathname, i);
-		}		
+	/* All the benchmarks are gone by now */
+	teardown_freezer();
 
+	/* If we are running in transparent mode, now it's the time to
+	 * dump all the snapshots. */
+	if (flag_transparent && !flag_mimic) {
+		drain_ring(0);
+
+		/* If the number of snapshots is in mismatch, the ring
+		 * was full at some point */
+		if (saved != snapshots) 
+			fprintf(stderr, "WARNING: Saved %d snapshots out of %d. "
+				"The others were dropped because the ring was full.\n",
+				saved, snapshots);
 	}	
 	
 	/* Now create pids file with metadata about the acquisition */
@@ -650,13 +1525,30 @@ void wrap_up (void)
 	len = sprintf(pathname, "%d\n", getpid());
 	write(pids_fd, pathname, len);
 	
-	for (i = 0; i < bm_count; ++i) {
+	for (i = 0; i < nr_pids; ++i) {
 		len = sprintf(pathname, "%d\n", pids[i]);
 		write(pids_fd, pathname, len);
 	}
 
 	close(pids_fd);
 	free(pathname);
+
+	/* Samples are laid out according to it */
+	write_geometry_file(outdir, &geom);
+	sample_state_free(&cur_state);
+
+	/* Only now make sure that the samples hit the disk */
+	if (capture_fd >= 0) {
+		fsync(capture_fd);
+		close(capture_fd);
+		capture_fd = -1;
+	}
+
+	if (shutter_buf) {
+		munmap(shutter_buf, shutter_mapped);
+		shutter_buf = NULL;
+		shutter_mapped = 0;
+	}
 }
 
 /* Set real-time SCHED_FIFO scheduler with given priority */
@@ -743,151 +1635,997 @@ void set_non_realtime(void)
 	}	
 }
 
-/* Install periodic snapshot handler and wait for completion using signals */
-void wait_completion(void)
+/* Start or stop (period_ns = 0) in-kernel periodic sampling */
+void kernel_sampler(unsigned long period_ns)
 {
-	sigset_t waitmask;
-	struct sigaction chld_sa;
-	struct sigaction timer_sa;
-	struct sigaction ext_sa;
-	
-	struct sigevent ev;
-	struct itimerspec it;
-	timer_t timer;
-	
-	/* Use RT POSIX extension */
-	chld_sa.sa_flags = SA_SIGINFO;
-	chld_sa.sa_sigaction = proc_exit_handler;
-	sigemptyset(&chld_sa.sa_mask);
-	sigaddset(&chld_sa.sa_mask, SIGCHLD);
-
-	/* Install SIGCHLD signal handler */
-	sigaction(SIGCHLD, &chld_sa, NULL);
-
-	/* Setup timer */
-	timer_sa.sa_flags = SA_SIGINFO;
-	timer_sa.sa_sigaction = snapshot_handler;
-	sigemptyset(&timer_sa.sa_mask);
-	sigaddset(&timer_sa.sa_mask, SIGRTMAX);
-	sigaddset(&timer_sa.sa_mask, SIGRTMAX-1);
-
-	/* Install SIGRTMAX signal handler */
-	sigaction(SIGRTMAX, &timer_sa, NULL);
-
-	/* Setup signal hanlder for external trigger */
-	ext_sa.sa_flags = SA_SIGINFO;
-	ext_sa.sa_sigaction = ext_snapshot_handler;
-	sigemptyset(&ext_sa.sa_mask);
-	sigaddset(&ext_sa.sa_mask, SIGRTMAX);
-	sigaddset(&ext_sa.sa_mask, SIGRTMAX-1);
-
-	/* Install SIGRTMAX signal handler */
-	sigaction(SIGRTMAX-1, &ext_sa, NULL);
-		
-	/* Timer creation */
-	memset(&ev, 0, sizeof(ev));
-	ev.sigev_notify = SIGEV_SIGNAL;
-	ev.sigev_signo = SIGRTMAX;
-
-	/* Pass a reference to the timer. */
-	ev.sigev_value.sival_ptr = (void *)&timer;
+	int dumpcache_fd = open_mod();
 
-	timer_create(CLOCK_REALTIME, &ev, &timer);
+	if (ioctl(dumpcache_fd, DUMPCACHE_CMD_PERIODIC, period_ns) < 0) {
+		perror("Unable to control in-kernel sampling");
+		exit(EXIT_FAILURE);
+	}
 
-	memset(&it, 0, sizeof(it));
-	it.it_value.tv_sec = 0;
-	it.it_value.tv_nsec = 1; /* Start immediately */
-	it.it_interval.tv_sec = 0;
-	it.it_interval.tv_nsec = 0; /* One shot mode for now. */
+	close(dumpcache_fd);
+}
 
+/* Start event-triggered sampling in the kernel, or stop it if t is
+ * NULL */
+void kernel_triggered_sampler(struct pmu_trigger * t)
+{
+	struct pmu_trigger stop = { 0, 0, 0 };
+	int dumpcache_fd = open_mod();
 
-	/* Start timer only if we are operating in periodic mode */
-	if (flag_periodic) {
-		timer_settime(timer, 0, &it, NULL);
-	}
-	    
-	printf("Setup completed!\n");
-	
-	/* Wait for any signal */
-	sigemptyset(&waitmask);
-	while(!done){
-		sigsuspend(&waitmask);
+	if (ioctl(dumpcache_fd, DUMPCACHE_CMD_TRIGGER, t ? t : &stop) < 0) {
+		perror("Unable to control event-triggered sampling");
+		exit(EXIT_FAILURE);
 	}
 
-	timer_delete(timer);
+	close(dumpcache_fd);
 }
 
+/* Add a descriptor to the set watched by the event loop */
+static void watch_fd(int epoll_fd, int fd)
+{
+	struct epoll_event ev;
 
-/* Entry function to interface with the kernel module via the proc interface */
-void read_cache_to_file(char * filename, int index) {
-	int outfile;
-	int dumpcache_fd;
-	int bytes_to_write = 0;
-	struct cache_sample * cache_contents;
-	
-	char csv_file_buf[WRITE_SIZE + 10*CSV_LINE_SIZE];
-	int cache_set_idx, cache_line_idx;
-	
-	cache_contents = NULL;
-	
-	if (((outfile = open(filename, O_CREAT | O_WRONLY | O_SYNC | O_TRUNC, 0666)) < 0)) {
-		perror("Failed to open outfile");
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("Unable to watch event source");
 		exit(EXIT_FAILURE);
 	}
-	
-	if (!cache_contents) {
-	    cache_contents = (struct cache_sample *)malloc(sizeof(struct cache_sample));
+}
+
+/* Take snapshots from an event loop until the benchmarks complete.
+ * Signals are read from a signalfd rather than handled
+ * asynchronously: SIGCHLD for completion, SIGRTMAX-1 for external
+ * triggers. */
+void wait_completion(void)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct signalfd_siginfo si;
+	struct itimerspec it;
+	sigset_t mask;
+	int epoll_fd, sig_fd, timer_fd, ring_fd = -1, attach_fd = -1;
+	int i, n;
+
+	/* Block the signals before the writer starts, so that it
+	 * inherits the mask and never receives them */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGRTMAX-1);
+
+	/* Attached processes are left running when interrupted */
+	if (nr_attach) {
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGTERM);
 	}
+	sigprocmask(SIG_BLOCK, &mask, NULL);
 
-	dumpcache_fd = open_mod();
+	/* Before any snapshot is taken */
+	start_writer();
 
-	if (flag_transparent) {
-		/* Make sure to ask the kernel for the buffer at the
-		 * specific index. */
-		int retval;
-		unsigned long cmd = DUMPCACHE_CMD_SETBUF_SHIFT;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 
-		cmd |= DUMPCACHE_CMD_VALUE(index);
-		
-		retval = ioctl(dumpcache_fd, DUMPCACHE_CMD_CONFIG, cmd);
-		if (retval < 0) {
-			perror("Unable to retrieve current buffer index from shutter");
+	if (epoll_fd < 0 || sig_fd < 0 || timer_fd < 0) {
+		perror("Unable to set up event loop");
+		exit(EXIT_FAILURE);
+	}
+
+	watch_fd(epoll_fd, sig_fd);
+	watch_fd(epoll_fd, timer_fd);
+
+	/* Save samples as they come, if streaming */
+	if (flag_stream && !flag_mimic) {
+		ring_fd = open_mod();
+		watch_fd(epoll_fd, ring_fd);
+	}
+
+	/* Look for new processes to attach to every now and then */
+	if (nr_attach) {
+		attach_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (attach_fd < 0) {
+			perror("Unable to set up event loop");
 			exit(EXIT_FAILURE);
 		}
 
+		memset(&it, 0, sizeof(it));
+		it.it_value.tv_sec = it.it_interval.tv_sec = REDISCOVER_MS / 1000;
+		it.it_value.tv_nsec = it.it_interval.tv_nsec = MS_TO_NS(REDISCOVER_MS % 1000);
+		timerfd_settime(attach_fd, 0, &it, NULL);
+		watch_fd(epoll_fd, attach_fd);
 	}
-	
-	if (read(dumpcache_fd, cache_contents, sizeof(struct cache_sample)) < 0) {
-		perror("Failed to read from proc file");
-		exit(EXIT_FAILURE);
+
+	/* Start timer only if we are operating in periodic mode. In
+	 * kernel-timed mode the module is in charge instead. */
+	if (flag_kernel_timer && !flag_mimic) {
+		kernel_sampler(kernel_period_us * 1000UL);
+	} else if (flag_kernel_trigger && !flag_mimic) {
+		kernel_triggered_sampler(&kernel_trigger);
+	} else if (flag_periodic) {
+		/* First deadline is now, i.e. start immediately */
+		memset(&it, 0, sizeof(it));
+		clock_gettime(CLOCK_MONOTONIC, &it.it_value);
+		it.it_interval.tv_sec = snap_period_ms / 1000;
+		it.it_interval.tv_nsec = MS_TO_NS(snap_period_ms % 1000);
+		timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &it, NULL);
 	}
-	
-	for (cache_set_idx = 0; cache_set_idx < NUM_CACHESETS; cache_set_idx++) {
-		for (cache_line_idx = 0; cache_line_idx < NUM_CACHELINES; cache_line_idx++) {
-			bytes_to_write += sprintf(csv_file_buf + bytes_to_write,
-						  "%05d,0x%012lx\n",
-						  cache_contents->sets[cache_set_idx]
-						  .cachelines[cache_line_idx].pid,
-						  cache_contents->sets[cache_set_idx]
-						  .cachelines[cache_line_idx].addr);
-			
-			/* Flush out pending data */			
-			if (bytes_to_write >= WRITE_SIZE){				
-				if (write(outfile, csv_file_buf, bytes_to_write) == -1) {
-					perror("Failed to write to outfile");
+
+	printf("Setup completed!\n");
+
+	/* Benchmarks might have exited before SIGCHLD was blocked */
+	reap_benchmarks();
+
+	while(!done){
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0) {
+			perror("Unable to wait for events");
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < n && !done; ++i) {
+			if (events[i].data.fd == timer_fd) {
+				periodic_snapshot(timer_fd);
+			} else if (events[i].data.fd == ring_fd) {
+				drain_ring(0);
+			} else if (events[i].data.fd == attach_fd) {
+				uint64_t expirations;
+
+				if (read(attach_fd, &expirations, sizeof(expirations)) > 0 &&
+				    discover_targets(0) && module_needs_targets())
+					set_targets();
+			} else {
+				while (read(sig_fd, &si, sizeof(si)) == sizeof(si)) {
+					if (si.ssi_signo == SIGCHLD)
+						reap_benchmarks();
+					else if (si.ssi_signo == SIGRTMAX-1)
+						take_snapshot();
+					else
+						done = 1;
 				}
-				bytes_to_write = 0;
 			}
-		}   
+		}
 	}
-	
-	/* Flush out leftover buffer data */
-	if (bytes_to_write){
-		if (write(outfile, csv_file_buf, bytes_to_write) == -1) {
-			perror("Failed to write to outfile");
+
+	close(timer_fd);
+	close(sig_fd);
+	if (attach_fd >= 0)
+		close(attach_fd);
+	close(epoll_fd);
+	if (ring_fd >= 0)
+		close(ring_fd);
+
+	if (missed_deadlines)
+		fprintf(stderr, "WARNING: Missed %lu sampling deadlines, i.e. snapshots "
+			"took longer than the period of %ld msec.\n",
+			(unsigned long)missed_deadlines, snap_period_ms);
+
+	if ((flag_kernel_timer || flag_kernel_trigger) && !flag_mimic) {
+		struct ring_status status;
+		int dumpcache_fd;
+		
+		if (flag_kernel_timer)
+			kernel_sampler(0);
+		else
+			kernel_triggered_sampler(NULL);
+
+		/* Snapshots were not counted as they were taken */
+		dumpcache_fd = open_mod();
+		if (ioctl(dumpcache_fd, DUMPCACHE_CMD_RING_STATUS, &status) < 0) {
+			perror("Unable to retrieve ring status");
+			exit(EXIT_FAILURE);
 		}
+		close(dumpcache_fd);
+
+		snapshots = saved + status.pending + status.overruns;
+	}
+}
+
+
+/* Save all the samples pending in the ring to disk, optionally
+ * waiting for at least one to become available */
+void drain_ring(int wait)
+{
+	static char * pathname = NULL;
+	struct ring_status status;
+	struct pollfd pfd;
+	size_t offset;
+	uint32_t i;
+
+	if (!pathname)
+		pathname = (char *)malloc(strlen(outdir) + MALLOC_CMD_PAD);
+
+	pfd.fd = open_mod();
+	pfd.events = POLLIN;
+
+	/* Signals interrupt the wait, so that completion is noticed */
+	if (wait && poll(&pfd, 1, -1) <= 0) {
+		close(pfd.fd);
+		return;
+	}
+
+	if (ioctl(pfd.fd, DUMPCACHE_CMD_RING_STATUS, &status) < 0) {
+		perror("Unable to retrieve ring status");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Samples from the tail on are stable until released */
+	for (i = 0, offset = status.tail; i < status.pending; ++i) {
+		sprintf(pathname, "%s/cachedump%d.csv", outdir, saved++);
+		offset = read_cache_to_file(pathname, offset, 0);
+	}
+
+	if (status.pending &&
+	    ioctl(pfd.fd, DUMPCACHE_CMD_RING_CONSUME, (unsigned long)status.pending) < 0) {
+		perror("Unable to release samples");
+		exit(EXIT_FAILURE);
 	}
 	
-	close(outfile);
-	close(dumpcache_fd);
+	close(pfd.fd);
+}
+
+/* Make sure that at least the first len bytes of the buffers are mapped */
+char * map_buffers(size_t len)
+{
+	int dumpcache_fd;
+	size_t map_len;
+	void * map;
+
+	if (len <= shutter_mapped)
+		return shutter_buf;
+	
+	if (shutter_buf)
+		munmap(shutter_buf, shutter_mapped);
+	
+	dumpcache_fd = open_mod();
+
+	/* Grow geometrically to keep the number of remaps low when
+	 * walking variable-size samples. The module lays out the
+	 * samples back to back, so the mapping can be indexed by
+	 * offset. */
+	map_len = (len > 2 * shutter_mapped ? len : 2 * shutter_mapped);
+	map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, dumpcache_fd, 0);
+
+	/* We might have asked for more than the module has */
+	if (map == MAP_FAILED && map_len > len) {
+		map_len = len;
+		map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, dumpcache_fd, 0);
+	}
+	
+	if (map == MAP_FAILED) {
+		perror("Unable to map sample buffers");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The mapping stays valid after the descriptor is closed */
+	close(dumpcache_fd);
+	
+	shutter_buf = (char *)map;
+	shutter_mapped = map_len;
+	
+	return shutter_buf;
+}
+
+/* Find the variable-size record at offset, skipping the unused tail
+ * of the first aperture, or of the ring when wrapping around. The
+ * offset is moved to the record, which is mapped in full. */
+static struct sample_hdr * record_at(size_t * offset)
+{
+	struct sample_hdr * hdr;
+
+	if (*offset >= ring_len)
+		*offset = 0;
+	hdr = (struct sample_hdr *)(map_buffers(*offset + sizeof(*hdr)) + *offset);
+	while (hdr->magic == SAMPLE_MAGIC_PAD) {
+		*offset += hdr->size;
+		if (*offset >= ring_len)
+			*offset = 0;
+		hdr = (struct sample_hdr *)(map_buffers(*offset + sizeof(*hdr)) + *offset);
+	}
+
+	if (!sample_is_valid(hdr) && hdr->magic != SAMPLE_MAGIC_AGGREGATE) {
+		fprintf(stderr, "Invalid packed sample at offset %zu\n", *offset);
+		exit(EXIT_FAILURE);
+	}
+
+	return (struct sample_hdr *)(map_buffers(*offset + hdr->size) + *offset);
+}
+
+/* Clock of the timestamps of the capture file, in ns */
+static uint64_t monotonic_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* When the module started to acquire a sample, as CLOCK_MONOTONIC in
+ * ns, or 0 if the sample has no timing section */
+static uint64_t sample_start_ns(const void * sample)
+{
+	const struct sample_timing * timing = NULL;
+
+	if (flag_packed || flag_delta || flag_aggregate)
+		timing = sample_timing_section((const struct sample_hdr *)sample);
+	else if (full_sections & SAMPLE_FLAG_TIMING)
+		timing = (const struct sample_timing *)
+			((const char *)sample + sample_size - TIMING_SECTION_SIZE);
+
+	return timing ? timing->start_ns : 0;
+}
+
+void capture_open(unsigned long config)
+{
+	static char pathname[PATH_MAX];
+	struct capture_header hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CAPTURE_VERSION;
+	hdr.size = sizeof(hdr);
+	hdr.geom = geom;
+	hdr.sel = selection;
+	hdr.config = config;
+	hdr.sections = full_sections;
+	hdr.benchmarks = bm_count;
+
+	if (flag_packed || flag_delta || flag_aggregate)
+		hdr.format = CAPTURE_FORMAT_RECORDS;
+	else
+		hdr.format = CAPTURE_FORMAT_FULL;
+
+	if (flag_kernel_timer)
+		hdr.period_us = kernel_period_us;
+	else if (flag_periodic && !flag_kernel_trigger)
+		hdr.period_us = snap_period_ms * MICROSECONDS_IN_MILLISECONDS;
+
+	/* Same clock as the records */
+	hdr.start = monotonic_ns();
+
+	snprintf(pathname, PATH_MAX, "%s/" CAPTURE_FILENAME, outdir);
+	if ((capture_fd = open(pathname, O_CREAT | O_WRONLY | O_TRUNC, 0666)) < 0) {
+		perror("Failed to open capture file");
+		exit(EXIT_FAILURE);
+	}
+
+	if (write(capture_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		perror("Failed to write capture file");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Samples are copied straight from the mapped buffers, with no
+ * intermediate copy nor synchronous write */
+void capture_append(const void * sample, uint32_t size, uint64_t timestamp)
+{
+	struct capture_record rec;
+	struct iovec iov[2];
+
+	rec.size = size;
+	rec.index = captured++;
+
+	/* The module knows best when the sample was acquired. Lacking
+	 * both, now is the closest to it. */
+	rec.timestamp = sample_start_ns(sample);
+	if (!rec.timestamp)
+		rec.timestamp = timestamp ? timestamp : monotonic_ns();
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *)sample;
+	iov[1].iov_len = size;
+
+	if (writev(capture_fd, iov, 2) != (ssize_t)(sizeof(rec) + size)) {
+		perror("Failed to write capture file");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Records are self-describing, samples in the full format are not */
+void save_sample(char * filename, const void * sample, size_t size, uint64_t timestamp)
+{
+	const struct sample_hdr * hdr = (const struct sample_hdr *)sample;
+
+	if (flag_binary) {
+		capture_append(sample, size, timestamp);
+	} else if (flag_packed || flag_delta || flag_aggregate) {
+		if (write_record_to_csv(filename, &cur_state, hdr, &csv_opts) < 0) {
+			fprintf(stderr, "Unexpected record of magic 0x%x\n", hdr->magic);
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		write_full_to_csv(filename, sample, &geom, full_sections, &csv_opts);
+	}
+}
+
+/* Entry function to interface with the kernel module via the proc
+ * interface. Returns the offset of the sample that follows. */
+size_t read_cache_to_file(char * filename, size_t offset, uint64_t timestamp) {
+	void * sample;
+	size_t size;
+
+	if (flag_packed || flag_delta || flag_aggregate) {
+		struct sample_hdr * hdr = record_at(&offset);
+
+		sample = hdr;
+		size = hdr->size;
+	} else {
+		if (offset >= ring_len)
+			offset = 0;
+
+		/* Walk the sample in place. No copy needed. */
+		sample = map_buffers(offset + sample_size) + offset;
+		size = sample_size;
+	}
+
+	save_sample(filename, sample, size, timestamp);
+
+	return offset + size;
+}
+
+/* Grow a buffer of the pool to hold at least size bytes */
+static char * pool_grow(char * buf, size_t * capacity, size_t size)
+{
+	if (size <= *capacity)
+		return buf;
+
+	while (*capacity < size)
+		*capacity = *capacity ? 2 * *capacity : size;
+
+	if (!(buf = (char *)realloc(buf, *capacity))) {
+		perror("Unable to grow snapshot pool");
+		exit(EXIT_FAILURE);
+	}
+
+	return buf;
+}
+
+/* Copy the sample in the first buffer of the module, which is
+ * overwritten by the next snapshot */
+static void grab_sample(struct pending_snapshot * snap)
+{
+	size_t offset = 0;
+	const void * sample;
+	size_t size;
+
+	if (flag_packed || flag_delta || flag_aggregate) {
+		struct sample_hdr * hdr = record_at(&offset);
+
+		sample = hdr;
+		size = hdr->size;
+	} else {
+		sample = map_buffers(sample_size);
+		size = sample_size;
+	}
+
+	snap->sample = pool_grow(snap->sample, &snap->capacity, size);
+	memcpy(snap->sample, sample, size);
+	snap->size = size;
+}
+
+/* Read /proc/pid/maps in memory. Its content is generated when read,
+ * so this cannot be left for after the benchmark resumes. */
+static void grab_maps(pid_t pid, struct maps_copy * maps)
+{
+	char proc_entry[MALLOC_CMD_PAD];
+	ssize_t num_read;
+	int src_fd;
+
+	maps->pid = pid;
+	maps->len = 0;
+
+	sprintf(proc_entry, "/proc/%d/maps", pid);
+	if ((src_fd = open(proc_entry, O_RDONLY)) < 0)
+		return;
+
+	do {
+		maps->buf = pool_grow(maps->buf, &maps->capacity, maps->len + BUF_SIZE);
+		num_read = read(src_fd, maps->buf + maps->len, maps->capacity - maps->len);
+		if (num_read > 0)
+			maps->len += num_read;
+	} while (num_read > 0);
+
+	close(src_fd);
+}
+
+/* Wait for a free slot in the pool. This happens before the
+ * benchmarks are stopped, so that they keep running meanwhile. */
+static struct pending_snapshot * pool_reserve(void)
+{
+	if (sem_trywait(&pool_free) < 0) {
+		++writer_waits;
+		while (sem_wait(&pool_free) < 0 && errno == EINTR)
+			;
+	}
+
+	return &pool[pool_head % writer_slots];
+}
+
+/* Hand the slot reserved last over to the writer thread */
+static void pool_commit(void)
+{
+	++pool_head;
+	sem_post(&pool_full);
+}
+
+/* Freeze or thaw the cgroup of the benchmarks */
+static void freezer_write(const char * value)
+{
+	size_t len = strlen(value);
+
+	if (pwrite(freezer_fd, value, len, 0) != (ssize_t)len) {
+		perror("Unable to freeze or thaw the benchmarks");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Freeze the benchmarks and wait until all their processes are
+ * frozen. cgroup.events is notified when that happens. The v1
+ * freezer has no notification, so its state is polled. */
+static void freezer_freeze(void)
+{
+	struct pollfd pfd;
+	char buf[128];
+	ssize_t len;
+
+	freezer_write(freezer_v1 ? "FROZEN" : "1");
+
+	for (;;) {
+		len = pread(freezer_v1 ? freezer_fd : freezer_events_fd, buf, sizeof(buf) - 1, 0);
+		if (len < 0) {
+			perror("Unable to read freezer state");
+			exit(EXIT_FAILURE);
+		}
+		buf[len] = '\0';
+
+		if (freezer_v1 && !strncmp(buf, "FROZEN", 6))
+			break;
+		if (!freezer_v1 && strstr(buf, "frozen 1"))
+			break;
+
+		if (freezer_v1) {
+			/* Let the tasks of this CPU freeze */
+			usleep(FREEZER_POLL_US);
+		} else {
+			pfd.fd = freezer_events_fd;
+			pfd.events = POLLPRI;
+			poll(&pfd, 1, FREEZER_POLL_MS);
+		}
+	}
+}
+
+/* Stop all the benchmarks, with their threads and children when they
+ * are frozen through a cgroup */
+static void stop_benchmarks(void)
+{
+	int i;
+
+	if (flag_async)
+		return;
+
+	targets_stopped = 1;
+
+	if (freezer_fd >= 0) {
+		freezer_freeze();
+		return;
+	}
+
+	/* Send SIGSTOP to all the processes */
+	for (i = 0; i < nr_pids; ++i) {
+		if (still_running(i))
+			kill(pids[i], SIGSTOP);
+	}
+}
+
+static void resume_benchmarks(void)
+{
+	int i;
+
+	if (flag_async)
+		return;
+
+	targets_stopped = 0;
+
+	if (freezer_fd >= 0) {
+		freezer_write(freezer_v1 ? "THAWED" : "0");
+		return;
+	}
+
+	/* Resume all the processes with SIGCONT */
+	for (i = 0; i < nr_pids; ++i) {
+		if (still_running(i))
+			kill(pids[i], SIGCONT);
+	}
+}
+
+/* Find the mount point of the hierarchy the freezer cgroup is in:
+ * the v2 one, or the v1 one with the freezer controller */
+static int find_freezer_root(void)
+{
+	static char line[2 * PATH_MAX];
+	char type[32], options[256];
+	char * sep;
+	FILE * in;
+	int found = 0;
+
+	if (!(in = fopen("/proc/self/mountinfo", "r")))
+		return -1;
+
+	/* Optional fields end with a lone dash, followed by the type
+	 * and the options of the file system */
+	while (!found && fgets(line, sizeof(line), in)) {
+		if (!(sep = strstr(line, " - ")) ||
+		    sscanf(line, "%*s %*s %*s %*s %4095s", freezer_root) != 1 ||
+		    sscanf(sep, " - %31s %*s %255s", type, options) != 2)
+			continue;
+
+		if (freezer_v1)
+			found = !strcmp(type, "cgroup") && strstr(options, "freezer");
+		else
+			found = !strcmp(type, "cgroup2");
+
+		/* There can be more than one mount of either */
+		found = found && !strncmp(freezer_dir, freezer_root, strlen(freezer_root));
+	}
+
+	fclose(in);
+	return found ? 0 : -1;
+}
+
+void setup_freezer(void)
+{
+	static char pathname[PATH_MAX];
+
+	if (mkdir(freezer_path, 0755) == 0) {
+		freezer_created = 1;
+	} else if (errno != EEXIST) {
+		perror("Unable to create benchmark cgroup");
+		exit(EXIT_FAILURE);
+	}
+
+	/* cgroup v2 from Linux 5.2, otherwise a v1 freezer hierarchy */
+	snprintf(pathname, PATH_MAX, "%s/cgroup.freeze", freezer_path);
+	if ((freezer_fd = open(pathname, O_WRONLY)) < 0) {
+		snprintf(pathname, PATH_MAX, "%s/freezer.state", freezer_path);
+		freezer_fd = open(pathname, O_RDWR);
+		freezer_v1 = 1;
+	}
+
+	if (freezer_fd < 0) {
+		fprintf(stderr, "%s has neither cgroup.freeze nor freezer.state\n", freezer_path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!freezer_v1) {
+		snprintf(pathname, PATH_MAX, "%s/cgroup.events", freezer_path);
+		if ((freezer_events_fd = open(pathname, O_RDONLY)) < 0) {
+			perror("Unable to open cgroup.events");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Attached processes are moved back when done, so where they
+	 * come from must be known */
+	if (nr_attach && (!realpath(freezer_path, freezer_dir) || find_freezer_root() < 0)) {
+		fprintf(stderr, "Unable to find the cgroup hierarchy of %s\n", freezer_path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Benchmarks call this before exec, so that anything they fork
+ * starts in the cgroup too. Returns -1 if an attached process exited
+ * before it could be moved. */
+int join_freezer(pid_t pid)
+{
+	if (cgroup_move(freezer_path, pid) == 0)
+		return 0;
+
+	if (pid && errno == ESRCH) {
+		printf("PID %d Gone.\n", pid);
+		return -1;
+	}
+
+	perror("Unable to join benchmark cgroup");
+	exit(EXIT_FAILURE);
+}
+
+/* Where a process left in the cgroup of the benchmarks goes back to:
+ * the origin of the closest attached process it descends from */
+static const char * origin_of(pid_t pid)
+{
+	char buf[BUF_SIZE];
+	char * fields;
+	int i;
+
+	while (pid > 1) {
+		for (i = bm_count; i < nr_pids; ++i) {
+			if (pids[i] == pid && pid_origin[i])
+				return pid_origin[i];
+		}
+
+		/* The parent follows the state */
+		if (!(fields = stat_fields(pid, buf, sizeof(buf))) ||
+		    sscanf(fields, " %*c %d", &pid) != 1)
+			return NULL;
+	}
+
+	return NULL;
+}
+
+/* Move the attached processes back to the cgroups -Z took them from,
+ * along with what they forked meanwhile */
+static void restore_attached(void)
+{
+	static char pathname[PATH_MAX];
+	const char * origin;
+	FILE * in;
+	pid_t pid;
+
+	snprintf(pathname, PATH_MAX, "%s/cgroup.procs", freezer_path);
+	if (!(in = fopen(pathname, "r")))
+		return;
+
+	while (fscanf(in, "%d", &pid) == 1) {
+		if (!(origin = origin_of(pid)))
+			continue;
+
+		if (cgroup_move(origin, pid) < 0)
+			fprintf(stderr, "WARNING: Unable to move PID %d back to %s: %s\n",
+				pid, origin, strerror(errno));
+	}
+
+	fclose(in);
+}
+
+void teardown_freezer(void)
+{
+	if (freezer_fd < 0)
+		return;
+
+	/* In case the last snapshot was interrupted */
+	freezer_write(freezer_v1 ? "THAWED" : "0");
+
+	restore_attached();
+
+	close(freezer_fd);
+	freezer_fd = -1;
+	if (freezer_events_fd >= 0) {
+		close(freezer_events_fd);
+		freezer_events_fd = -1;
+	}
+
+	/* Only empty cgroups can be removed */
+	if (freezer_created && rmdir(freezer_path) < 0)
+		perror("WARNING: Unable to remove benchmark cgroup");
+}
+
+void release_targets(void)
+{
+	const char * thaw = freezer_v1 ? "THAWED" : "0";
+	int i;
+
+	/* Not torn down yet: whatever the state of the cgroup, thaw
+	 * it and let attached processes go. Best effort, as exiting
+	 * again from here is not allowed. */
+	if (freezer_fd >= 0) {
+		if (pwrite(freezer_fd, thaw, strlen(thaw), 0) < 0)
+			perror("WARNING: Unable to thaw the benchmarks");
+		restore_attached();
+		return;
+	}
+
+	if (!targets_stopped)
+		return;
+
+	for (i = 0; i < nr_pids; ++i) {
+		if (still_running(i))
+			kill(pids[i], SIGCONT);
+	}
+}
+
+void take_snapshot(void)
+{
+	static char * __cmd = NULL;
+	static char __proc_entry[MALLOC_CMD_PAD];
+	struct pending_snapshot * snap = NULL;
+	uint64_t timestamp;
+	int i;
+
+	/* Should happen only once */
+	if (!__cmd)
+		__cmd = (char *)malloc(strlen(outdir) + MALLOC_CMD_PAD);
+
+	if (pool) {
+		snap = pool_reserve();
+		snap->index = snapshots;
+		snap->size = 0;
+		snap->nr_maps = 0;
+	}
+
+	/* Stop all the benchmarks (skip in async mode) */
+	stop_benchmarks();
+
+	/* Skip all of this in mimic mode */
+	if(!flag_mimic) {
+		/* Ask the module to acquire a new snapshot.*/
+		timestamp = monotonic_ns();
+		acquire_new_snapshot();
+
+		/* Unless we are in transparent mode, save cache dump
+		 * to file right away, or leave it to the writer */
+		if (!flag_transparent && snap) {
+			grab_sample(snap);
+			snap->timestamp = timestamp;
+		} else if (!flag_transparent) {
+			sprintf(__cmd, "%s/cachedump%d.csv", outdir, snapshots);
+
+			/* In non-transparent mode, no autoincrement
+			 * is selected in the kernel, so we always
+			 * read the first buffer. */
+			read_cache_to_file(__cmd, 0, timestamp);
+		}
+	}
+
+	/* Acquire maps files if layout acquisition is selected */
+	if (flag_bm_layout) {
+		/* Initiate a /proc/pid/maps dump to file */
+		for (i = 0; i < nr_pids; ++i) {
+			if (!pid_live[i])
+				continue;
+
+			if (snap) {
+				grab_maps(pids[i], &snap->maps[snap->nr_maps++]);
+				continue;
+			}
+
+			sprintf(__cmd, "%s/%d-%d.txt", outdir, pids[i], snapshots);
+			sprintf(__proc_entry, "/proc/%d/maps", pids[i]);
+			copy_file(__proc_entry, __cmd);
+		}
+	}
+
+	/* Resume all the benchmarks (skip in async mode) */
+	resume_benchmarks();
+
+	if (snap)
+		pool_commit();
+
+	/* Keep track of the total number of snapshots acquired so far */
+	++snapshots;
+}
+
+/* Save what take_snapshot() grabbed, in order, while the
+ * benchmarks run */
+static void * writer_thread(void * arg)
+{
+	struct pending_snapshot * snap;
+	char * pathname;
+	int fd, i;
+
+	(void)arg;
+
+	pathname = (char *)malloc(strlen(outdir) + MALLOC_CMD_PAD);
+
+	for (;;) {
+		while (sem_wait(&pool_full) < 0 && errno == EINTR)
+			;
+
+		snap = &pool[pool_tail % writer_slots];
+		if (snap->index < 0)
+			break;
+
+		if (snap->size) {
+			sprintf(pathname, "%s/cachedump%d.csv", outdir, snap->index);
+			save_sample(pathname, snap->sample, snap->size, snap->timestamp);
+		}
+
+		for (i = 0; i < snap->nr_maps; ++i) {
+			/* Processes that just exited have no maps */
+			if (!snap->maps[i].len)
+				continue;
+
+			sprintf(pathname, "%s/%d-%d.txt", outdir, snap->maps[i].pid, snap->index);
+			if ((fd = open(pathname, O_RDWR | O_CREAT | O_TRUNC, 0700)) < 0) {
+				perror("Unable to save maps file.");
+				exit(EXIT_FAILURE);
+			}
+
+			if (write(fd, snap->maps[i].buf, snap->maps[i].len) !=
+			    (ssize_t)snap->maps[i].len) {
+				perror("Unable to write maps file.");
+				exit(EXIT_FAILURE);
+			}
+			close(fd);
+		}
+
+		++pool_tail;
+		sem_post(&pool_free);
+	}
+
+	free(pathname);
+	return NULL;
+}
+
+void start_writer(void)
+{
+	struct sched_param sp;
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int i, ret;
+
+	if (!writer_slots)
+		return;
+
+	if (!(pool = (struct pending_snapshot *)calloc(writer_slots, sizeof(*pool)))) {
+		perror("Unable to allocate snapshot pool");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Size the buffers of full samples up front, so that the
+	 * snapshots do not allocate in the common case. Records grow
+	 * their slot the first time it is too small. */
+	for (i = 0; i < writer_slots; ++i) {
+		if (!flag_transparent && !flag_mimic &&
+		    !flag_packed && !flag_delta && !flag_aggregate)
+			pool[i].sample = pool_grow(NULL, &pool[i].capacity, sample_size);
+	}
+
+	sem_init(&pool_free, 0, writer_slots);
+	sem_init(&pool_full, 0, 0);
+
+	/* Run below any real-time priority, on the CPU of the parent:
+	 * snapshots preempt the writer, and the writer never takes
+	 * time from the benchmarks */
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	memset(&sp, 0, sizeof(sp));
+	pthread_attr_setschedparam(&attr, &sp);
+	CPU_ZERO(&set);
+	CPU_SET(PARENT_CPU, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	if ((ret = pthread_create(&writer, &attr, writer_thread, NULL))) {
+		errno = ret;
+		perror("Unable to start writer thread");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+void stop_writer(void)
+{
+	int i, j;
+
+	if (!pool)
+		return;
+
+	/* Queued behind the pending snapshots */
+	pool_reserve()->index = -1;
+	pool_commit();
+	pthread_join(writer, NULL);
+
+	if (writer_waits)
+		fprintf(stderr, "WARNING: %d snapshots were delayed waiting for the writer. "
+			"Consider a larger -Q or a longer period.\n", writer_waits);
+
+	for (i = 0; i < writer_slots; ++i) {
+		free(pool[i].sample);
+		for (j = 0; j < MAX_OBSERVED; ++j)
+			free(pool[i].maps[j].buf);
+	}
+
+	sem_destroy(&pool_free);
+	sem_destroy(&pool_full);
+	free(pool);
+	pool = NULL;
 }